@@ -1,5 +1,7 @@
 #!/bin/sh
 
+# cinit-depends:
+
 set -e # Exit immediately if a command exits with a non-zero status.
 set -u # Treat unset variables as an error.
 
@@ -4,6 +4,8 @@
 # Handle the VNC password.
 #
 
+# cinit-depends: 10-clean-tmp-dir.sh 10-set-tmp-dir-perms.sh
+
 set -e # Exit immediately if a command exits with a non-zero status.
 set -u # Treat unset variables as an error.
 
@@ -0,0 +1,295 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+
+#include "cgroup.h"
+
+/**
+ * Mount point of the cgroup v2 hierarchy.
+ */
+#ifndef CGROUP_MOUNT_POINT
+#define CGROUP_MOUNT_POINT "/sys/fs/cgroup"
+#endif
+
+/**
+ * Name of the leaf cgroup receiving processes of our own cgroup.  With cgroup
+ * v2, a cgroup having controllers enabled for its children cannot contain
+ * processes itself.
+ */
+#define CGROUP_INIT_LEAF "init.scope"
+
+/**
+ * Controllers we want to enable for child cgroups.
+ */
+static const char * const wanted_controllers[] = {
+    "cpu",
+    "memory",
+    "io",
+    "pids",
+};
+
+/* Path of our cgroup, under which child cgroups are created. */
+static char base_path[PATH_MAX / 2] = "";
+
+/* Controllers enabled for child cgroups. */
+static char enabled_controllers[64] = "";
+
+/**
+ * Build the path of a child cgroup or of one of its interface files.
+ *
+ * @param[out] path Buffer where to store the path.  Its size must be PATH_MAX.
+ * @param[in] name Name of the child cgroup.
+ * @param[in] file Name of the interface file or NULL.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int build_path(char *path, const char *name, const char *file)
+{
+    int len;
+
+    if (base_path[0] == '\0') {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    if (file) {
+        len = snprintf(path, PATH_MAX, "%s/%s/%s", base_path, name, file);
+    }
+    else {
+        len = snprintf(path, PATH_MAX, "%s/%s", base_path, name);
+    }
+
+    if (len < 0 || len >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Write a string to a file.
+ *
+ * @param[in] path Path of the file.
+ * @param[in] value String to write.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int write_file(const char *path, const char *value)
+{
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    ssize_t len = strlen(value);
+    if (write(fd, value, len) != len) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    return close(fd);
+}
+
+/**
+ * Read the content of a small file.
+ *
+ * @param[in] path Path of the file.
+ * @param[out] buf Buffer where to store the NULL terminated content.
+ * @param[in] bufsize Size of the buffer.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int read_small_file(const char *path, char *buf, size_t bufsize)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    ssize_t len = read(fd, buf, bufsize - 1);
+    close(fd);
+    if (len < 0) {
+        return -1;
+    }
+    buf[len] = '\0';
+    return 0;
+}
+
+/**
+ * Check if a controller is part of a space separated list.
+ *
+ * @param[in] list List of controllers.
+ * @param[in] controller Name of the controller.
+ *
+ * @return 1 if the controller is in the list, 0 otherwise.
+ */
+static int has_controller(const char *list, const char *controller)
+{
+    size_t len = strlen(controller);
+
+    for (const char *p = strstr(list, controller); p; p = strstr(p + len, controller)) {
+        if ((p == list || p[-1] == ' ') &&
+            (p[len] == '\0' || p[len] == ' ' || p[len] == '\n')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Move all processes of our cgroup to the leaf cgroup.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int move_processes_to_leaf()
+{
+    char path[PATH_MAX];
+    char leaf_procs[PATH_MAX];
+    char pid[32];
+
+    snprintf(path, sizeof(path), "%s/cgroup.procs", base_path);
+    snprintf(leaf_procs, sizeof(leaf_procs), "%s/%s/cgroup.procs", base_path, CGROUP_INIT_LEAF);
+
+    FILE *f = fopen(path, "re");
+    if (!f) {
+        return -1;
+    }
+
+    // Processes that exited in the meantime are ignored.
+    while (fgets(pid, sizeof(pid), f)) {
+        if (write_file(leaf_procs, pid) < 0 && errno != ESRCH) {
+            int saved_errno = errno;
+            fclose(f);
+            errno = saved_errno;
+            return -1;
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+int cgroup_init()
+{
+    struct statfs sfs;
+    char buf[1024];
+    char path[PATH_MAX];
+
+    // Make sure the unified hierarchy is mounted.
+    if (statfs(CGROUP_MOUNT_POINT, &sfs) < 0) {
+        return -1;
+    }
+    else if (sfs.f_type != CGROUP2_SUPER_MAGIC) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    // Find our cgroup.  With cgroup v2, /proc/self/cgroup contains a single
+    // "0::<path>" line.
+    if (read_small_file("/proc/self/cgroup", buf, sizeof(buf)) < 0) {
+        return -1;
+    }
+    char *cgroup = strstr(buf, "0::");
+    if (!cgroup || (cgroup != buf && cgroup[-1] != '\n')) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    cgroup += 3;
+    cgroup[strcspn(cgroup, "\n")] = '\0';
+    snprintf(base_path, sizeof(base_path), "%s%s", CGROUP_MOUNT_POINT,
+             strcmp(cgroup, "/") == 0 ? "" : cgroup);
+
+    // Make sure the hierarchy is delegated to us.
+    snprintf(path, sizeof(path), "%s/cgroup.subtree_control", base_path);
+    if (access(path, W_OK) < 0) {
+        base_path[0] = '\0';
+        return -1;
+    }
+
+    // Move our processes to the leaf cgroup.
+    if (cgroup_create(CGROUP_INIT_LEAF) < 0 || move_processes_to_leaf() < 0) {
+        base_path[0] = '\0';
+        return -1;
+    }
+
+    // Enable controllers.  A controller may be unavailable or not delegated:
+    // this is not considered an error.
+    snprintf(path, sizeof(path), "%s/cgroup.controllers", base_path);
+    if (read_small_file(path, buf, sizeof(buf)) < 0) {
+        base_path[0] = '\0';
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/cgroup.subtree_control", base_path);
+    for (size_t i = 0; i < sizeof(wanted_controllers) / sizeof(wanted_controllers[0]); i++) {
+        char value[32];
+
+        if (!has_controller(buf, wanted_controllers[i])) {
+            continue;
+        }
+
+        snprintf(value, sizeof(value), "+%s", wanted_controllers[i]);
+        if (write_file(path, value) == 0) {
+            size_t len = strlen(enabled_controllers);
+            snprintf(enabled_controllers + len, sizeof(enabled_controllers) - len,
+                     "%s%s", len ? " " : "", wanted_controllers[i]);
+        }
+    }
+
+    return 0;
+}
+
+const char *cgroup_controllers()
+{
+    return enabled_controllers;
+}
+
+int cgroup_create(const char *name)
+{
+    char path[PATH_MAX];
+
+    if (build_path(path, name, NULL) < 0) {
+        return -1;
+    }
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+        return -1;
+    }
+    return 0;
+}
+
+int cgroup_remove(const char *name)
+{
+    char path[PATH_MAX];
+
+    if (build_path(path, name, NULL) < 0) {
+        return -1;
+    }
+    return rmdir(path);
+}
+
+int cgroup_set(const char *name, const char *file, const char *value)
+{
+    char path[PATH_MAX];
+
+    if (build_path(path, name, file) < 0) {
+        return -1;
+    }
+    return write_file(path, value);
+}
+
+int cgroup_attach(const char *name, pid_t pid)
+{
+    char value[32];
+
+    snprintf(value, sizeof(value), "%d", pid);
+    return cgroup_set(name, "cgroup.procs", value);
+}
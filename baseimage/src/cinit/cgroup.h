@@ -0,0 +1,72 @@
+#ifndef __CINIT_CGROUP_H__
+#define __CINIT_CGROUP_H__
+
+#include <sys/types.h>
+
+/**
+ * Control groups (v2) management.
+ *
+ * When the cgroup v2 hierarchy is delegated to us, processes of our own cgroup
+ * are moved to a leaf cgroup and available controllers are enabled for child
+ * cgroups.  Each service can then be placed in its own child cgroup, where
+ * resource controls can be applied.
+ */
+
+/**
+ * Initialize the cgroup hierarchy.
+ *
+ * @return 0 on success, -1 if cgroup v2 is not available or not delegated.
+ */
+int cgroup_init();
+
+/**
+ * Get the list of controllers enabled for child cgroups.
+ *
+ * @return Space separated list of controllers.
+ */
+const char *cgroup_controllers();
+
+/**
+ * Create a child cgroup.
+ *
+ * It is not an error if the cgroup already exists.
+ *
+ * @param[in] name Name of the cgroup.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int cgroup_create(const char *name);
+
+/**
+ * Remove a child cgroup.
+ *
+ * @param[in] name Name of the cgroup.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int cgroup_remove(const char *name);
+
+/**
+ * Write a value to an interface file of a child cgroup.
+ *
+ * @param[in] name Name of the cgroup.
+ * @param[in] file Name of the interface file (e.g. "memory.max").
+ * @param[in] value Value to write.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int cgroup_set(const char *name, const char *file, const char *value);
+
+/**
+ * Move a process to a child cgroup.
+ *
+ * No memory is allocated: this function can be called from a forked child.
+ *
+ * @param[in] name Name of the cgroup.
+ * @param[in] pid PID of the process to move, 0 for the calling process.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int cgroup_attach(const char *name, pid_t pid);
+
+#endif // __CINIT_CGROUP_H__
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -18,9 +20,18 @@
 #include <ctype.h>
 #include <pty.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/syscall.h>
 
 #include "utils.h"
 #include "log.h"
+#include "logstore.h"
+#include "ctl.h"
+#include "proc.h"
+#include "cgroup.h"
+#include "snapshot.h"
+#include "stages.h"
 #include "CException.h"
 
 #if ATOMIC_BOOL_LOCK_FREE != 2
@@ -41,10 +52,41 @@
 #define SERVICES_DEFAULT_ROOT "/etc/services.d"
 #endif
 
-/*
- * Path of the named pipe (FIFO) used to received commands.
+/**
+ * Suffix appended to the root directory path to get the default path of the
+ * services configuration snapshot.
+ */
+#define SNAPSHOT_DEFAULT_SUFFIX ".snapshot"
+
+/**
+ * Directories of the container initialization stages.
+ */
+#ifndef CONT_ENV_DIR
+#define CONT_ENV_DIR "/etc/cont-env.d"
+#endif
+#ifndef CONT_SECRETS_DIR
+#define CONT_SECRETS_DIR "/run/secrets"
+#endif
+#ifndef CONT_INIT_DIR
+#define CONT_INIT_DIR "/etc/cont-init.d"
+#endif
+
+/**
+ * Default path of the Unix socket used to receive control requests.
+ */
+#ifndef CTL_DEFAULT_SOCKET_PATH
+#define CTL_DEFAULT_SOCKET_PATH "/tmp/.cinit.sock"
+#endif
+
+/**
+ * Name of the group allowed to send control requests.
  */
-#define CMD_FIFO_PATH "/tmp/.cinit_cmd"
+#define CTL_SOCKET_GROUP "cinit"
+
+/**
+ * Default number of lines returned by the log control request.
+ */
+#define CTL_DEFAULT_LOG_LINES 50
 
 /**
  * The maximum number of supported services.
@@ -96,6 +138,19 @@
  */
 #define SERVICE_DEFAULT_MIN_RUNNING_TIME 500
 
+/**
+ * Default size (in bytes) of the buffer keeping the most recent output of a
+ * service.
+ */
+#define SERVICE_DEFAULT_LOG_BUFFER_SIZE 32768
+
+/**
+ * Limits of the size (in bytes) of the buffer keeping the most recent output of
+ * a service.
+ */
+#define SERVICE_MIN_LOG_BUFFER_SIZE 1024
+#define SERVICE_MAX_LOG_BUFFER_SIZE (16 * 1024 * 1024)
+
 /**
  * Default UID to use for services.
  */
@@ -116,6 +171,31 @@
  */
 #define SERVICE_SGID_LIST_SIZE 32
 
+/**
+ * Default I/O priority level of services using the best-effort I/O scheduling
+ * class.
+ */
+#define SERVICE_DEFAULT_IO_PRIORITY 4
+
+/**
+ * Definitions needed by the ioprio_set() system call, which has no libc
+ * wrapper.
+ */
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+
+/**
+ * Suffix of the name of the cgroup created for a service.
+ */
+#define SERVICE_CGROUP_SUFFIX ".service"
+
+/**
+ * Maximum length of a cgroup resource control value, including the
+ * terminating NULL character.
+ */
+#define CGROUP_VALUE_MAX_LENGTH 32
+
 #define FMT_LONG 41 /* enough space to hold -2^127 in decimal, plus \0 */
 
 #define MEMBER_SIZE(t, f) (sizeof(((t*)0)->f))
@@ -133,12 +213,12 @@
 #define ASSERT_VALID_SERVICE_INDEX(sid) ASSERT_LOG(sid >= 0 && sid < DIM(g_ctx.services), "Invalid service ID %d.", sid)
 #define ASSERT_UNREACHABLE_POINT() assert(!"Unreachable point reached.")
 
-#define log(fmt, arg...) log_stdout("[%-*s] " fmt "\n", g_ctx.log_prefix_length, g_ctx.progname, ##arg)
-#define log_err(fmt, arg...) log_stderr("[%-*s] ERROR: " fmt "\n", g_ctx.log_prefix_length, g_ctx.progname, ##arg)
-#define log_fatal(fmt, arg...) log_stderr("[%-*s] FATAL: " fmt "\n", g_ctx.log_prefix_length, g_ctx.progname, ##arg)
+#define log(fmt, arg...) log_message(g_ctx.progname, g_ctx.log_prefix_length, false, fmt, ##arg)
+#define log_err(fmt, arg...) log_message(g_ctx.progname, g_ctx.log_prefix_length, true, "ERROR: " fmt, ##arg)
+#define log_fatal(fmt, arg...) log_message(g_ctx.progname, g_ctx.log_prefix_length, true, "FATAL: " fmt, ##arg)
 #define log_debug(fmt, arg...) do { \
     if (g_ctx.debug) { \
-        log_stdout("[%-*s] " fmt "\n", g_ctx.log_prefix_length, g_ctx.progname, ##arg); \
+        log_message(g_ctx.progname, g_ctx.log_prefix_length, false, fmt, ##arg); \
     } \
 } while (0)
 
@@ -166,6 +246,10 @@ typedef struct {
     size_t sgid_list_size;
     mode_t umask;
     int priority;
+    int sched_policy;
+    cpu_set_t cpu_affinity;
+    int io_class;
+    unsigned int io_priority;
     char working_directory[255 + 1];
     bool respawn;
     bool sync;
@@ -174,6 +258,15 @@ typedef struct {
     unsigned int min_running_time;
     unsigned int ready_timeout;
     unsigned int interval;
+    unsigned int log_rate_limit;
+    unsigned int log_burst;
+    unsigned int log_buffer_size;
+    char cpu_weight[CGROUP_VALUE_MAX_LENGTH];
+    char io_weight[CGROUP_VALUE_MAX_LENGTH];
+    char memory_high[CGROUP_VALUE_MAX_LENGTH];
+    char memory_max[CGROUP_VALUE_MAX_LENGTH];
+    char pids_max[CGROUP_VALUE_MAX_LENGTH];
+    char cgroup[255 + sizeof(SERVICE_CGROUP_SUFFIX)];
 
     pid_t pid;
     unsigned long start_time;
@@ -187,14 +280,30 @@ typedef struct {
     atomic_bool logger_exit;
     bool logger_started;
     bool restart_requested;
+    bool stop_requested;
+    unsigned int restart_count;
+    int last_exit_status;
+    proc_stats_t exited_stats;
+    log_buffer_t log_buffer;
+    log_rate_limit_t log_rate_limiter;
 } service_t;
 
 /** Context definition. */
 typedef struct {
     char progname[255 + 1];               /**< Our program name. */
     char services_root[255 + 1];          /**< Root directory of services. */
+    char snapshot_path[255 + 1];          /**< Path of the services configuration snapshot. */
+    bool compile;                         /**< Whether or not to compile the snapshot and exit. */
+    bool run_stages;                      /**< Whether or not to run the container initialization stages. */
+    char ctl_socket_path[107 + 1];        /**< Path of the control socket. */
+    const char *ctl_request;              /**< Control request to send, when acting as a client. */
+    const char *metrics_address;          /**< Address of the HTTP metrics endpoint, if enabled. */
+    const char *log_store_dir;            /**< Directory of the log store, if enabled. */
+    const char *log_query;                /**< Query of the log store to run, when acting as a client. */
+    unsigned long boot_time;              /**< Time (in msec) at which we started. */
     int log_prefix_length;                /**< Length of log prefixes. */
     bool debug;                           /**< Whether or not debug is enabled. */
+    bool cgroup_enabled;                  /**< Whether or not services are placed in their own cgroup. */
     unsigned int services_gracetime;      /**< Services gracetimes (msec). */
     unsigned int default_srv_ready_timeout; /**< Maximum time (in msec) to wait for a service to be ready. */
 
@@ -213,12 +322,27 @@ extern char **environ;
 
 static volatile bool do_shutdown = false;
 
+/* Termination signal received, reported by the main loop. */
+static volatile sig_atomic_t shutdown_signal = 0;
+
+/* Pipe used to wake up the main loop from signal handlers. */
+static int wakeup_pipe[2] = { -1, -1 };
+
 /* Declare the global context. */
 static context_t g_ctx = {
     .progname = DEFAULT_PROGRAM_NAME,
     .services_root = SERVICES_DEFAULT_ROOT,
+    .snapshot_path = "",
+    .compile = false,
+    .run_stages = false,
+    .ctl_socket_path = CTL_DEFAULT_SOCKET_PATH,
+    .ctl_request = NULL,
+    .metrics_address = NULL,
+    .log_store_dir = NULL,
+    .log_query = NULL,
     .log_prefix_length = strlen(DEFAULT_PROGRAM_NAME),
     .debug = false,
+    .cgroup_enabled = false,
     .services_gracetime = SERVICES_DEFAULT_GRACETIME,
     .default_srv_ready_timeout = SERVICE_DEFAULT_READY_TIMEOUT,
     .default_srv_uid = SERVICE_DEFAULT_UID,
@@ -230,11 +354,20 @@ static context_t g_ctx = {
     .exit_code = 0,
 };
 
-static const char* const short_options = "dhr:g:t:p:u:i:m:s:";
+static const char* const short_options = "dhr:g:t:p:u:i:m:s:c:S:M:Cf:xF:L:q:";
 static struct option long_options[] = {
     { "debug", no_argument, NULL, 'd' },
+    { "control", required_argument, NULL, 'c' },
+    { "control-socket", required_argument, NULL, 'S' },
+    { "metrics-listen", required_argument, NULL, 'M' },
     { "progname", required_argument, NULL, 'p' },
     { "root-directory", required_argument, NULL, 'r' },
+    { "compile", no_argument, NULL, 'C' },
+    { "snapshot-file", required_argument, NULL, 'f' },
+    { "run-stages", no_argument, NULL, 'x' },
+    { "log-format", required_argument, NULL, 'F' },
+    { "log-store", required_argument, NULL, 'L' },
+    { "query-log", required_argument, NULL, 'q' },
     { "services-gracetime", required_argument, NULL, 'g' },
     { "default-service-ready-timeout", required_argument, NULL, 't' },
     { "default-service-uid", required_argument, NULL, 'u' },
@@ -246,7 +379,7 @@ static struct option long_options[] = {
 };
 
 // Forward declarations of internal functions.
-static void handle_killed(pid_t killed, int status);
+static void handle_killed(pid_t killed, int status, const struct rusage *usage);
 
 /**
  * Print error message with the latest errno and exit.
@@ -265,6 +398,22 @@ static void err(int eval, const char *fmt, ...)
     _exit(eval);
 }
 
+/**
+ * Wake up the main loop.
+ *
+ * This function is async-signal-safe.
+ */
+static void wakeup_main_loop()
+{
+    int saved_errno = errno;
+    if (wakeup_pipe[1] >= 0) {
+        char c = 0;
+        ssize_t rc = write(wakeup_pipe[1], &c, sizeof(c));
+        (void)rc;
+    }
+    errno = saved_errno;
+}
+
 /**
  * Handler of the CHLD signal.
  *
@@ -272,7 +421,7 @@ static void err(int eval, const char *fmt, ...)
  */
 static void sigchild(int sig)
 {
-    // Nothing to do.
+    wakeup_main_loop();
 }
 
 /**
@@ -282,8 +431,9 @@ static void sigchild(int sig)
  */
 static void sigint(int sig)
 {
-    log("SIGTINT received, shutting down...");
+    shutdown_signal = sig;
     REQUEST_SHUTDOWN();
+    wakeup_main_loop();
 }
 
 /**
@@ -293,8 +443,9 @@ static void sigint(int sig)
  */
 static void sigterm(int sig)
 {
-    log("SIGTERM received, shutting down...");
+    shutdown_signal = sig;
     REQUEST_SHUTDOWN();
+    wakeup_main_loop();
 }
 
 /**
@@ -493,10 +644,17 @@ static void *service_logger(void *p)
     snprintf(prefix, sizeof(prefix), "[%-*s] ", g_ctx.log_prefix_length, SRV(service).name);
 
     // Start the logger.
+    log_source_t source = {
+        .name = SRV(service).name,
+        .prefix = prefix,
+        .buffer = &SRV(service).log_buffer,
+        .rate_limit = &SRV(service).log_rate_limiter,
+        .store = (g_ctx.log_store_dir != NULL),
+    };
 #ifdef SINGLE_CHILD_STDOUT_STDERR_STREAM
-    log_prefixer(prefix, SRV(service).output_fd, -1, &SRV(service).logger_exit);
+    log_prefixer(&source, SRV(service).output_fd, -1, &SRV(service).logger_exit);
 #else
-    log_prefixer(prefix, SRV(service).stdout_fd, SRV(service).stderr_fd, &SRV(service).logger_exit);
+    log_prefixer(&source, SRV(service).stdout_fd, SRV(service).stderr_fd, &SRV(service).logger_exit);
 #endif
 
     return NULL;
@@ -549,6 +707,9 @@ static void chdir_to_service(const char *service)
                 ThrowMessageWithErrno("could not access service directory");
         }
     }
+
+    // Keep the snapshot in sync with the current directory.
+    snapshot_chdir(service);
 }
 
 /**
@@ -647,9 +808,110 @@ static void unload_service(int service)
         SRV(service).run_abs_path = NULL;
     }
 
+    log_buffer_free(&SRV(service).log_buffer);
+
+    if (SRV(service).cgroup[0] != '\0') {
+        cgroup_remove(SRV(service).cgroup);
+    }
+
     memset(&SRV(service), 0, sizeof(SRV(service)));
 }
 
+/**
+ * Check the existence and permissions of a service configuration item.
+ *
+ * The services configuration snapshot is used when available.
+ *
+ * NOTE: Must be called from inside the service directory.
+ *
+ * @param[in] name Name of the item.
+ * @param[in] mode Accessibility check to perform: F_OK or X_OK.
+ *
+ * @return true if the check succeeded, false otherwise.
+ */
+static bool service_item_access(const char *name, int mode)
+{
+    snapshot_item_t item;
+
+    switch (snapshot_lookup(name, &item)) {
+        case 0:
+            return false;
+        case 1:
+            return mode != X_OK || item.executable;
+        default:
+            return access(name, mode) == 0;
+    }
+}
+
+/**
+ * Get the canonical, absolute path of a service configuration item.
+ *
+ * The services configuration snapshot is used when available.
+ *
+ * NOTE: Must be called from inside the service directory.
+ *
+ * @param[in] name Name of the item.
+ *
+ * @return Dynamically allocated path or NULL on error.
+ */
+static char *service_item_realpath(const char *name)
+{
+    snapshot_item_t item;
+
+    if (snapshot_lookup(name, &item) == 1 && item.realpath) {
+        return strdup(item.realpath);
+    }
+    return realpath(name, NULL);
+}
+
+/**
+ * Load configuration item as a cgroup resource control value.
+ *
+ * The value is either "max" or an unsigned integer.  When allowed, the integer
+ * can be followed by a K, M, G or T suffix.
+ *
+ * @param[in] filepath Path to the configuration item file to load.
+ * @param[out] buf Where the result will be stored.
+ * @param[in] bufsize Size of the buffer.
+ * @param[in] allow_max Whether or not "max" is a valid value.
+ * @param[in] allow_suffix Whether or not a unit suffix is allowed.
+ *
+ * @return true if the value was loaded, false if value was not set.
+ */
+static bool load_value_as_cgroup_value(const char *filepath, char *buf, size_t bufsize, bool allow_max, bool allow_suffix)
+{
+    char value[CGROUP_VALUE_MAX_LENGTH] = "";
+    char *ptr = value;
+
+    if (!load_value_as_string(filepath, &ptr, sizeof(value))) {
+        return false;
+    }
+
+    terminate_at_first_eol(value);
+    ptr = trim(value);
+
+    // An empty value means the setting is not set.
+    if (ptr[0] == '\0') {
+        return false;
+    }
+
+    if (!allow_max || strcmp(ptr, "max") != 0) {
+        size_t len = strspn(ptr, "0123456789");
+        if (len == 0) {
+            ThrowMessage("could not load '%s': invalid value", filepath);
+        }
+        else if (allow_suffix && ptr[len] != '\0' && strchr("KMGT", ptr[len])) {
+            len++;
+        }
+        if (ptr[len] != '\0') {
+            ThrowMessage("could not load '%s': invalid value", filepath);
+        }
+    }
+
+    snprintf(buf, bufsize, "%s", ptr);
+    return true;
+}
+
 /**
  * Load a service in service table.
  *
@@ -702,9 +964,13 @@ static int load_service(const char *service)
         SRV(sid).umask = g_ctx.default_srv_umask;
         SRV(sid).ready_timeout = g_ctx.default_srv_ready_timeout;
         SRV(sid).min_running_time = SERVICE_DEFAULT_MIN_RUNNING_TIME;
+        SRV(sid).last_exit_status = -1;
+        SRV(sid).sched_policy = -1;
+        SRV(sid).io_class = IOPRIO_CLASS_NONE;
+        SRV(sid).io_priority = SERVICE_DEFAULT_IO_PRIORITY;
 
         // Check if this is a service group.
-        SRV(sid).is_service_group = (access("run", F_OK) != 0);
+        SRV(sid).is_service_group = !service_item_access("run", F_OK);
 
         // Check if service is disabled.
         load_value_as_bool("disabled", &SRV(sid).disabled);
@@ -716,13 +982,13 @@ static int load_service(const char *service)
         }
 
         // Make sure the run file is executable.
-        if (access("run", X_OK) != 0) {
+        if (!service_item_access("run", X_OK)) {
             ThrowMessage("run file not executable");
         }
 
         // Save the absolute path of the run program.
         {
-            SRV(sid).run_abs_path = realpath("run", NULL);
+            SRV(sid).run_abs_path = service_item_realpath("run");
             if (!SRV(sid).run_abs_path) {
                 ThrowMessageWithErrno("could not get realpath of run program");
             }
@@ -940,6 +1206,20 @@ static int load_service(const char *service)
         }
         load_value_as_mode("umask", &SRV(sid).umask);
         load_value_as_int("priority", &SRV(sid).priority);
+        load_value_as_sched_policy("sched_policy", &SRV(sid).sched_policy);
+        load_value_as_cpu_set("cpu_affinity", &SRV(sid).cpu_affinity);
+        load_value_as_io_class("io_class", &SRV(sid).io_class);
+        if (load_value_as_uint("io_priority", &SRV(sid).io_priority)) {
+            if (SRV(sid).io_priority > 7) {
+                ThrowMessage("could not load 'io_priority': out of range");
+            }
+            else if (SRV(sid).io_class == IOPRIO_CLASS_IDLE) {
+                ThrowMessage("'io_priority' cannot be used with the idle I/O scheduling class");
+            }
+            else if (SRV(sid).io_class == IOPRIO_CLASS_NONE) {
+                SRV(sid).io_class = IOPRIO_CLASS_BE;
+            }
+        }
         {
             char *ptr = SRV(sid).working_directory;
             load_value_as_string("workdir", &ptr, sizeof(SRV(sid).working_directory));
@@ -952,6 +1232,26 @@ static int load_service(const char *service)
         load_value_as_uint("min_running_time", &SRV(sid).min_running_time);
         load_value_as_uint("ready_timeout", &SRV(sid).ready_timeout);
         load_value_as_interval("interval", &SRV(sid).interval);
+        load_value_as_uint("log_rate_limit", &SRV(sid).log_rate_limit);
+        load_value_as_uint("log_burst", &SRV(sid).log_burst);
+        SRV(sid).log_buffer_size = SERVICE_DEFAULT_LOG_BUFFER_SIZE;
+        load_value_as_uint("log_buffer_size", &SRV(sid).log_buffer_size);
+        {
+            bool has_resource_controls = false;
+
+            has_resource_controls |= load_value_as_cgroup_value("cpu_weight", SRV(sid).cpu_weight, sizeof(SRV(sid).cpu_weight), false, false);
+            has_resource_controls |= load_value_as_cgroup_value("io_weight", SRV(sid).io_weight, sizeof(SRV(sid).io_weight), false, false);
+            has_resource_controls |= load_value_as_cgroup_value("memory_high", SRV(sid).memory_high, sizeof(SRV(sid).memory_high), true, true);
+            has_resource_controls |= load_value_as_cgroup_value("memory_max", SRV(sid).memory_max, sizeof(SRV(sid).memory_max), true, true);
+            has_resource_controls |= load_value_as_cgroup_value("pids_max", SRV(sid).pids_max, sizeof(SRV(sid).pids_max), true, false);
+
+            if (g_ctx.cgroup_enabled) {
+                snprintf(SRV(sid).cgroup, sizeof(SRV(sid).cgroup), "%s%s", service, SERVICE_CGROUP_SUFFIX);
+            }
+            else if (has_resource_controls) {
+                log("resource controls of service '%s' ignored: cgroup v2 not available.", service);
+            }
+        }
 
         // Do some validations.
         if (SRV(sid).respawn && SRV(sid).sync) {
@@ -960,6 +1260,14 @@ static int load_service(const char *service)
         else if (SRV(sid).respawn && SRV(sid).interval > 0) {
             ThrowMessage("interval cannot be used with respawned service");
         }
+        else if (SRV(sid).log_burst > 0 && SRV(sid).log_rate_limit == 0) {
+            ThrowMessage("'log_burst' requires 'log_rate_limit'");
+        }
+        else if (SRV(sid).log_buffer_size < SERVICE_MIN_LOG_BUFFER_SIZE ||
+                 SRV(sid).log_buffer_size > SERVICE_MAX_LOG_BUFFER_SIZE) {
+            ThrowMessage("log buffer size must be between %d and %d bytes",
+                    SERVICE_MIN_LOG_BUFFER_SIZE, SERVICE_MAX_LOG_BUFFER_SIZE);
+        }
 
         // The per-service ready timeout is configured statically, while the
         // default value can be adjusted dynamically. If the default value is
@@ -967,6 +1275,14 @@ static int load_service(const char *service)
         // value should be taken instead.
         SRV(sid).ready_timeout = MAX(SRV(sid).ready_timeout, g_ctx.default_srv_ready_timeout);
 
+        // Allocate the buffer keeping the most recent output.
+        if (log_buffer_init(&SRV(sid).log_buffer, SRV(sid).log_buffer_size) < 0) {
+            ThrowMessage("out of memory");
+        }
+
+        // Initialize the rate limit of the output.
+        log_rate_limit_init(&SRV(sid).log_rate_limiter, SRV(sid).log_rate_limit, SRV(sid).log_burst);
+
         // PID of 0 means service not running.
         SRV(sid).pid = 0;
 
@@ -1065,6 +1381,15 @@ static pid_t fork_and_exec(int service)
             setpgrp();
 #endif
 
+            // Move to the service's cgroup.  A failure is not fatal: the
+            // service runs without its resource controls.
+            if (SRV(service).cgroup[0] != '\0') {
+                if (cgroup_attach(SRV(service).cgroup, 0) < 0) {
+                    fprintf(stderr, "could not move to cgroup '%s': %s\n",
+                            SRV(service).cgroup, strerror(errno));
+                }
+            }
+
             // Get the canonical, absolute path of the program to run.
             char *argv0 = SRV(service).run_abs_path;
             if (!argv0) {
@@ -1140,6 +1465,32 @@ static pid_t fork_and_exec(int service)
                 }
             }
 
+            // Set scheduling policy.  The system call is used directly
+            // because some libc implementations (e.g. musl) don't implement
+            // sched_setscheduler().
+            if (SRV(service).sched_policy >= 0) {
+                struct sched_param param = { .sched_priority = 0 };
+                if (syscall(SYS_sched_setscheduler, 0, SRV(service).sched_policy, &param) < 0) {
+                    err(50, "sched_setscheduler(%d)", SRV(service).sched_policy);
+                }
+            }
+
+            // Set CPU affinity.
+            if (CPU_COUNT(&SRV(service).cpu_affinity) > 0) {
+                if (sched_setaffinity(0, sizeof(SRV(service).cpu_affinity), &SRV(service).cpu_affinity) < 0) {
+                    err(50, "sched_setaffinity");
+                }
+            }
+
+            // Set I/O priority.
+            if (SRV(service).io_class != IOPRIO_CLASS_NONE) {
+                int ioprio = IOPRIO_PRIO_VALUE(SRV(service).io_class,
+                        SRV(service).io_class == IOPRIO_CLASS_BE ? SRV(service).io_priority : 0);
+                if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) < 0) {
+                    err(50, "ioprio_set(%d)", ioprio);
+                }
+            }
+
             // Set umask.
             umask(SRV(service).umask);
 
@@ -1194,6 +1545,54 @@ static pid_t fork_and_exec(int service)
     }
 }
 
+/**
+ * Create the cgroup of a service and apply its resource controls.
+ *
+ * Failures are logged but are not fatal: the service can still run without
+ * its resource controls.
+ *
+ * @param[in] service Index of the service.
+ */
+static void setup_service_cgroup(int service)
+{
+    ASSERT_VALID_SERVICE_INDEX(service);
+
+    const struct {
+        const char *file;
+        const char *value;
+    } settings[] = {
+        { "cpu.weight", SRV(service).cpu_weight },
+        { "io.weight", SRV(service).io_weight },
+        { "memory.high", SRV(service).memory_high },
+        { "memory.max", SRV(service).memory_max },
+        { "pids.max", SRV(service).pids_max },
+    };
+
+    if (SRV(service).cgroup[0] == '\0') {
+        return;
+    }
+
+    if (cgroup_create(SRV(service).cgroup) < 0) {
+        log_err("could not create cgroup of service '%s': %s.",
+                SRV(service).name, strerror(errno));
+        SRV(service).cgroup[0] = '\0';
+        return;
+    }
+
+    for (int i = 0; i < DIM(settings); i++) {
+        if (settings[i].value[0] == '\0') {
+            continue;
+        }
+        if (cgroup_set(SRV(service).cgroup, settings[i].file, settings[i].value) < 0) {
+            log_err("could not set %s of service '%s' to '%s': %s.",
+                    settings[i].file,
+                    SRV(service).name,
+                    settings[i].value,
+                    strerror(errno));
+        }
+    }
+}
+
 /**
  * Start a service.
  *
@@ -1218,6 +1617,9 @@ static void start_service(int service)
     // Change the working directory to the service directory.
     chdir_to_service(SRV(service).name);
 
+    // Make sure the cgroup of the service is ready.
+    setup_service_cgroup(service);
+
     // Fork and exec service, put PID in data structure.
     for (int count = 0; count < 4; count++) {
         SRV(service).pid = fork_and_exec(service);
@@ -1316,8 +1718,36 @@ static void load_service_with_deps(const char *service, int dependent)
     // Update the start order.
     add_to_start_order(sid, dependent);
 
-    // Load dependencies.
-    {
+    // Load dependencies.  The snapshot is used when available, else the
+    // service directory is scanned.
+    snapshot_item_t item;
+    if (snapshot_get_item(0, &item) >= 0) {
+        for (unsigned int i = 0; snapshot_get_item(i, &item) > 0; i++) {
+            bool depends = false;
+            char dep[MEMBER_SIZE(service_t, name)];
+
+            if (!item.regular) {
+                continue;
+            }
+            if (!ends_with(item.name, ".dep")) {
+                continue;
+            }
+
+            // Check the dependency state.
+            load_value_as_bool(item.name, &depends);
+            if (!depends) {
+                continue;
+            }
+
+            // Remove the '.dep' suffix.
+            snprintf(dep, sizeof(dep), "%.*s", (int)(strlen(item.name) - 4), item.name);
+
+            // Load service, then get back to our service directory.
+            load_service_with_deps(dep, sid);
+            chdir_to_service(service);
+        }
+    }
+    else {
         struct dirent *dir;
         DIR *dirstream = opendir(".");
         if (!dirstream) {
@@ -1340,6 +1770,7 @@ static void load_service_with_deps(const char *service, int dependent)
             }
 
             // Check the dependency state.
+            depends = false;
             load_value_as_bool(dir->d_name, &depends);
             if (!depends) {
                 continue;
@@ -1350,8 +1781,9 @@ static void load_service_with_deps(const char *service, int dependent)
             assert(p);
             *p = '\0';
 
-            // Load service.
+            // Load service, then get back to our service directory.
             load_service_with_deps(dir->d_name, sid);
+            chdir_to_service(service);
         }
         closedir(dirstream);
     }
@@ -1419,9 +1851,10 @@ static void start_services()
             // Check if we need to wait for the service to terminate.
             if (SRV(sid).sync) {
                 int status;
+                struct rusage usage;
 
                 log_debug("waiting for service '%s' to terminate...", SRV(sid).name);
-                while (waitpid(SRV(sid).pid, &status, 0) < 0) {
+                while (wait4(SRV(sid).pid, &status, 0, &usage) < 0) {
                     if (errno == EINTR) {
                         if (SHUTDOWN_REQUESTED()) {
                             ExitTry();
@@ -1432,7 +1865,7 @@ static void start_services()
                     ThrowMessageWithErrno("could not wait for termination of service '%s'",
                             SRV(sid).name);
                 }
-                handle_killed(SRV(sid).pid, status);
+                handle_killed(SRV(sid).pid, status, &usage);
                 if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
                     ThrowMessage("termined with error");
                 }
@@ -1452,6 +1885,7 @@ static void start_services()
             while (true) {
                 int rc;
                 int status;
+                struct rusage usage;
 
                 // Exit now if shutdown has been requested.
                 if (SHUTDOWN_REQUESTED()) {
@@ -1465,10 +1899,10 @@ static void start_services()
                 }
 
                 // Check if service is still up.
-                rc = waitpid(SRV(sid).pid, &status, WNOHANG);
+                rc = wait4(SRV(sid).pid, &status, WNOHANG, &usage);
                 if (rc == SRV(sid).pid) {
                     // Service died.
-                    handle_killed(SRV(sid).pid, status);
+                    handle_killed(SRV(sid).pid, status, &usage);
                     ThrowMessage("minimum uptime not met");
                 }
                 else if (rc < 0) {
@@ -1524,8 +1958,9 @@ static void start_services()
  *
  * @param[in] pid PID of the killed service.
  * @param[in] status Status information of the killed service.
+ * @param[in] usage Resource usage of the killed service.
  */
-static void handle_killed(pid_t killed, int status)
+static void handle_killed(pid_t killed, int status, const struct rusage *usage)
 {
     CEXCEPTION_T e;
 
@@ -1557,6 +1992,14 @@ static void handle_killed(pid_t killed, int status)
 
         // Update service table.
         SRV(sid).pid = 0;
+        proc_add_rusage(usage, &SRV(sid).exited_stats);
+        if (WIFEXITED(status)) {
+            SRV(sid).last_exit_status = WEXITSTATUS(status);
+        }
+        else if (WIFSIGNALED(status)) {
+            // https://tldp.org/LDP/abs/html/exitcodes.html
+            SRV(sid).last_exit_status = 128 + WTERMSIG(status);
+        }
 
         // Join the logger thread.
         log_debug("waiting termination of logger thread of service '%s'...",
@@ -1600,7 +2043,7 @@ static void handle_killed(pid_t killed, int status)
         }
 
         // Check if termination of this service should trigger a shutdown.
-        if (!SHUTDOWN_REQUESTED() && !SRV(sid).restart_requested && SRV(sid).shutdown_on_terminate) {
+        if (!SHUTDOWN_REQUESTED() && !SRV(sid).restart_requested && !SRV(sid).stop_requested && SRV(sid).shutdown_on_terminate) {
             // Termination of the service should cause a shutdown.
             log("service '%s' exited, shutting down...", SRV(sid).name);
             REQUEST_SHUTDOWN();
@@ -1638,10 +2081,11 @@ static bool child_handler(int period, int service)
 
     while (true) {
         int status;
+        struct rusage usage;
 
         do {
-            killed = waitpid(-1, &status, WNOHANG);
-            handle_killed(killed, status);
+            killed = wait4(-1, &status, WNOHANG, &usage);
+            handle_killed(killed, status, &usage);
         } while (killed && killed != (pid_t)-1);
 
         if (killed == (pid_t)-1) {
@@ -1734,8 +2178,515 @@ static void cinit_shutdown()
     child_handler(-1, -1);
 }
 
+/**
+ * Get the state of a service, as reported to control clients.
+ *
+ * @param[in] service Index of the service.
+ *
+ * @return String representation of the service state.
+ */
+static const char *service_state_to_str(int service)
+{
+    ASSERT_VALID_SERVICE_INDEX(service);
+
+    if (SRV(service).disabled) {
+        return "disabled";
+    }
+    else if (SRV(service).is_service_group) {
+        return "group";
+    }
+    else if (SRV(service).pid != 0) {
+        return SRV(service).restart_requested ? "restarting" : "running";
+    }
+    else if (SRV(service).restart_requested || (SRV(service).respawn && !SRV(service).stop_requested)) {
+        return "restarting";
+    }
+    else {
+        return "stopped";
+    }
+}
+
+/**
+ * Send the status of a service to a control client.
+ *
+ * @param[in] fd File descriptor of the client connection.
+ * @param[in] service Index of the service.
+ */
+static void ctl_reply_service_status(int fd, int service)
+{
+    ASSERT_VALID_SERVICE_INDEX(service);
+
+    ctl_reply(fd, "%s state=%s pid=%d uptime=%lu restarts=%u last_exit=%d",
+            SRV(service).name,
+            service_state_to_str(service),
+            SRV(service).pid,
+            SRV(service).pid ? (get_time() - SRV(service).start_time) / 1000 : 0,
+            SRV(service).restart_count,
+            SRV(service).last_exit_status);
+}
+
+/**
+ * Write a metric family header in the Prometheus text format.
+ *
+ * @param[in] fd File descriptor where to write.
+ * @param[in] name Name of the metric.
+ * @param[in] type Type of the metric.
+ * @param[in] help Description of the metric.
+ */
+static void write_metric_header(int fd, const char *name, const char *type, const char *help)
+{
+    dprintf(fd, "# HELP %s %s\n", name, help);
+    dprintf(fd, "# TYPE %s %s\n", name, type);
+}
+
+/**
+ * Write resource usage and state of services in the Prometheus text format.
+ *
+ * @param[in] fd File descriptor where to write.
+ */
+static void write_metrics(int fd)
+{
+    proc_stats_t stats[MAX_NUM_SERVICES];
+
+    // Sample the resource usage of every service.  The usage of previous
+    // runs is added to counters.
+    FOR_EACH_SERVICE(sid) {
+        memset(&stats[sid], 0, sizeof(stats[sid]));
+        if (SRV(sid).pid != 0) {
+            proc_sample_group(SRV(sid).pid, &stats[sid]);
+        }
+        stats[sid].cpu_time += SRV(sid).exited_stats.cpu_time;
+        stats[sid].read_bytes += SRV(sid).exited_stats.read_bytes;
+        stats[sid].write_bytes += SRV(sid).exited_stats.write_bytes;
+    }
+
+#define FOR_EACH_METRIC_SERVICE(sid) \
+    FOR_EACH_SERVICE(sid) if (!SRV(sid).disabled && !SRV(sid).is_service_group)
+
+    write_metric_header(fd, "cinit_uptime_seconds", "gauge", "Time since the supervisor started.");
+    dprintf(fd, "cinit_uptime_seconds %.3f\n", (get_time() - g_ctx.boot_time) / 1000.0);
+
+    write_metric_header(fd, "cinit_service_up", "gauge", "Whether the service is running.");
+    FOR_EACH_METRIC_SERVICE(sid) {
+        dprintf(fd, "cinit_service_up{service=\"%s\"} %d\n", SRV(sid).name, SRV(sid).pid != 0);
+    }
+
+    write_metric_header(fd, "cinit_service_uptime_seconds", "gauge", "Time since the service started.");
+    FOR_EACH_METRIC_SERVICE(sid) {
+        dprintf(fd, "cinit_service_uptime_seconds{service=\"%s\"} %.3f\n", SRV(sid).name,
+                SRV(sid).pid ? (get_time() - SRV(sid).start_time) / 1000.0 : 0.0);
+    }
+
+    write_metric_header(fd, "cinit_service_restarts_total", "counter", "Number of times the service has been restarted.");
+    FOR_EACH_METRIC_SERVICE(sid) {
+        dprintf(fd, "cinit_service_restarts_total{service=\"%s\"} %u\n", SRV(sid).name, SRV(sid).restart_count);
+    }
+
+    write_metric_header(fd, "cinit_service_last_exit_status", "gauge", "Exit status of the last run of the service, -1 if it never exited.");
+    FOR_EACH_METRIC_SERVICE(sid) {
+        dprintf(fd, "cinit_service_last_exit_status{service=\"%s\"} %d\n", SRV(sid).name, SRV(sid).last_exit_status);
+    }
+
+    write_metric_header(fd, "cinit_service_processes", "gauge", "Number of processes of the service.");
+    FOR_EACH_METRIC_SERVICE(sid) {
+        dprintf(fd, "cinit_service_processes{service=\"%s\"} %u\n", SRV(sid).name, stats[sid].num_processes);
+    }
+
+    write_metric_header(fd, "cinit_service_cpu_seconds_total", "counter", "User and system CPU time consumed by the service.");
+    FOR_EACH_METRIC_SERVICE(sid) {
+        dprintf(fd, "cinit_service_cpu_seconds_total{service=\"%s\"} %.3f\n", SRV(sid).name, stats[sid].cpu_time / 1000.0);
+    }
+
+    write_metric_header(fd, "cinit_service_memory_rss_bytes", "gauge", "Resident set size of the service.");
+    FOR_EACH_METRIC_SERVICE(sid) {
+        dprintf(fd, "cinit_service_memory_rss_bytes{service=\"%s\"} %llu\n", SRV(sid).name, stats[sid].rss);
+    }
+
+    write_metric_header(fd, "cinit_service_memory_pss_bytes", "gauge", "Proportional set size of the service.");
+    FOR_EACH_METRIC_SERVICE(sid) {
+        dprintf(fd, "cinit_service_memory_pss_bytes{service=\"%s\"} %llu\n", SRV(sid).name, stats[sid].pss);
+    }
+
+    write_metric_header(fd, "cinit_service_io_read_bytes_total", "counter", "Bytes read from storage by the service.");
+    FOR_EACH_METRIC_SERVICE(sid) {
+        dprintf(fd, "cinit_service_io_read_bytes_total{service=\"%s\"} %llu\n", SRV(sid).name, stats[sid].read_bytes);
+    }
+
+    write_metric_header(fd, "cinit_service_log_lines_suppressed_total", "counter", "Lines of output suppressed by the log rate limit.");
+    FOR_EACH_METRIC_SERVICE(sid) {
+        dprintf(fd, "cinit_service_log_lines_suppressed_total{service=\"%s\"} %lu\n", SRV(sid).name,
+                atomic_load(&SRV(sid).log_rate_limiter.total_suppressed));
+    }
+
+    write_metric_header(fd, "cinit_service_io_write_bytes_total", "counter", "Bytes written to storage by the service.");
+    FOR_EACH_METRIC_SERVICE(sid) {
+        dprintf(fd, "cinit_service_io_write_bytes_total{service=\"%s\"} %llu\n", SRV(sid).name, stats[sid].write_bytes);
+    }
+
+#undef FOR_EACH_METRIC_SERVICE
+}
+
+/**
+ * Send the most recent output of a service to a control client.
+ *
+ * @param[in] fd File descriptor of the client connection.
+ * @param[in] sid Index of the service.
+ * @param[in] lines Maximum number of lines to send, 0 for all lines.
+ * @param[in] since Only send lines logged at or after this time (in msec since
+ *                  the Epoch).
+ *
+ * @return Error message or NULL on success.
+ */
+static const char *ctl_reply_service_log(int fd, int sid, unsigned int lines, unsigned long long since)
+{
+    char *tail = log_buffer_tail(&SRV(sid).log_buffer, lines, since, false);
+    if (!tail) {
+        return "out of memory";
+    }
+    if (dprintf(fd, "%s", tail) < 0) {
+        free(tail);
+        return "could not send log";
+    }
+    free(tail);
+    return NULL;
+}
+
+/** Line of output of a service, used to merge output of all services. */
+typedef struct {
+    const char *line;
+    size_t len;
+    int sid;
+    unsigned int seq;
+} ctl_log_line_t;
+
+static int compare_log_lines(const void *a, const void *b)
+{
+    const ctl_log_line_t *la = (const ctl_log_line_t *)a;
+    const ctl_log_line_t *lb = (const ctl_log_line_t *)b;
+
+    // Lines start with their timestamp, sortable as a string.
+    int rc = strncmp(la->line, lb->line, LOG_BUFFER_TIMESTAMP_LENGTH);
+    if (rc == 0) {
+        rc = (la->sid != lb->sid) ? la->sid - lb->sid : (int)(la->seq - lb->seq);
+    }
+    return rc;
+}
+
+/**
+ * Send the most recent output of all services to a control client.
+ *
+ * Lines of all services are merged in chronological order.  Each one is
+ * prefixed with its timestamp and the name of its service.
+ *
+ * @param[in] fd File descriptor of the client connection.
+ * @param[in] lines Maximum number of lines to send, 0 for all lines.
+ * @param[in] since Only send lines logged at or after this time (in msec since
+ *                  the Epoch).
+ *
+ * @return Error message or NULL on success.
+ */
+static const char *ctl_reply_all_services_log(int fd, unsigned int lines, unsigned long long since)
+{
+    char *tails[MAX_NUM_SERVICES] = { NULL };
+    ctl_log_line_t *all_lines = NULL;
+    size_t num_lines = 0;
+    size_t max_num_lines = 0;
+    const char *err = NULL;
+
+    // Get the lines of all services.
+    FOR_EACH_SERVICE(sid) {
+        if (err) {
+            break;
+        }
+        else if (SRV(sid).disabled || SRV(sid).is_service_group) {
+            continue;
+        }
+
+        tails[sid] = log_buffer_tail(&SRV(sid).log_buffer, lines, since, true);
+        if (!tails[sid]) {
+            err = "out of memory";
+            break;
+        }
+
+        unsigned int seq = 0;
+        for (char *p = tails[sid]; *p; seq++) {
+            char *eol = strchr(p, '\n');
+            if (num_lines == max_num_lines) {
+                max_num_lines = max_num_lines ? max_num_lines * 2 : 256;
+                ctl_log_line_t *new_lines = realloc(all_lines, max_num_lines * sizeof(ctl_log_line_t));
+                if (!new_lines) {
+                    err = "out of memory";
+                    break;
+                }
+                all_lines = new_lines;
+            }
+            all_lines[num_lines++] = (ctl_log_line_t) {
+                .line = p,
+                .len = eol - p,
+                .sid = sid,
+                .seq = seq,
+            };
+            p = eol + 1;
+        }
+    }
+
+    // Merge lines in chronological order.
+    if (!err && num_lines > 0) {
+        qsort(all_lines, num_lines, sizeof(ctl_log_line_t), compare_log_lines);
+    }
+
+    // Send the most recent lines.
+    size_t first = (lines > 0 && num_lines > lines) ? num_lines - lines : 0;
+    for (size_t i = first; !err && i < num_lines; i++) {
+        const ctl_log_line_t *l = &all_lines[i];
+        if (dprintf(fd, "%.*s [%s] %.*s\n",
+                    LOG_BUFFER_TIMESTAMP_LENGTH, l->line,
+                    SRV(l->sid).name,
+                    (int)(l->len - LOG_BUFFER_TIMESTAMP_LENGTH - 1), l->line + LOG_BUFFER_TIMESTAMP_LENGTH + 1) < 0) {
+            err = "could not send log";
+        }
+    }
+
+    FOR_EACH_SERVICE(sid) {
+        free(tails[sid]);
+    }
+    free(all_lines);
+    return err;
+}
+
+/**
+ * Handle a request received from the control socket.
+ *
+ * @param[in] fd File descriptor of the client connection.
+ * @param[in] argc Number of arguments of the request.
+ * @param[in] argv Arguments of the request.  The first one is the command.
+ *
+ * @return Error message or NULL on success.
+ */
+static const char *handle_ctl_request(int fd, int argc, char *argv[])
+{
+    CEXCEPTION_T e;
+
+    static char errbuf[sizeof(e.mMessage)];
+
+    const char *cmd = argc > 0 ? argv[0] : "";
+    const char *service = argc > 1 ? argv[1] : NULL;
+    int sid = -1;
+
+    log_debug("control request '%s' received.", cmd);
+
+    // Validate the service argument of commands that require it.
+    if (strcmp(cmd, "start") == 0 ||
+        strcmp(cmd, "stop") == 0 ||
+        strcmp(cmd, "restart") == 0 ||
+        strcmp(cmd, "reload") == 0 ||
+        strcmp(cmd, "log") == 0) {
+        if (!service) {
+            return "service name required";
+        }
+    }
+    if (service && strcmp(cmd, "log") == 0 && strcmp(service, "*") == 0) {
+        // Log of all services.
+    }
+    else if (service) {
+        sid = find_service(service);
+        if (sid < 0) {
+            return "service not found";
+        }
+        else if (strcmp(cmd, "status") != 0 &&
+                 (SRV(sid).disabled || SRV(sid).is_service_group)) {
+            return "service is disabled or is a group";
+        }
+    }
+
+    if (strcmp(cmd, "status") == 0) {
+        if (sid >= 0) {
+            ctl_reply_service_status(fd, sid);
+        }
+        else {
+            FOR_EACH_SERVICE(i) {
+                ctl_reply_service_status(fd, i);
+            }
+        }
+    }
+    else if (strcmp(cmd, "start") == 0) {
+        if (is_service_started(sid)) {
+            return "service already running";
+        }
+        log("start request for service '%s' received.", SRV(sid).name);
+        SRV(sid).stop_requested = false;
+        Try {
+            start_service(sid);
+        }
+        Catch (e) {
+            snprintf(errbuf, sizeof(errbuf), "%s", e.mMessage);
+            return errbuf;
+        }
+    }
+    else if (strcmp(cmd, "stop") == 0) {
+        log("stop request for service '%s' received.", SRV(sid).name);
+        SRV(sid).stop_requested = true;
+        SRV(sid).restart_requested = false;
+        Try {
+            stop_service(sid);
+        }
+        Catch (e) {
+            snprintf(errbuf, sizeof(errbuf), "%s", e.mMessage);
+            return errbuf;
+        }
+    }
+    else if (strcmp(cmd, "restart") == 0) {
+        log("restart request for service '%s' received.", SRV(sid).name);
+        SRV(sid).stop_requested = false;
+        Try {
+            stop_service(sid);
+            SRV(sid).restart_requested = true;
+        }
+        Catch (e) {
+            snprintf(errbuf, sizeof(errbuf), "%s", e.mMessage);
+            return errbuf;
+        }
+    }
+    else if (strcmp(cmd, "reload") == 0) {
+        if (!is_service_started(sid)) {
+            return "service not running";
+        }
+        log("reload request for service '%s' received.", SRV(sid).name);
+        Try {
+            // Run the service's (optional) reload program, otherwise send the
+            // HUP signal.
+            chdir_to_service(SRV(sid).name);
+            if (access("reload", X_OK) == 0) {
+                char arg[FMT_LONG];
+                snprintf(arg, sizeof(arg), "%d", SRV(sid).pid);
+                if (exec_service_cmd(sid, "./reload", "reload", arg) != 0) {
+                    ThrowMessage("reload program failed");
+                }
+            }
+            else if (kill(SRV(sid).pid, SIGHUP) != 0) {
+                ThrowMessageWithErrno("could not send signal: ");
+            }
+        }
+        Catch (e) {
+            snprintf(errbuf, sizeof(errbuf), "%s", e.mMessage);
+            return errbuf;
+        }
+    }
+    else if (strcmp(cmd, "log") == 0) {
+        unsigned int lines = CTL_DEFAULT_LOG_LINES;
+        unsigned int since = 0;
+        if (argc > 2) {
+            Try {
+                string_to_uint(argv[2], &lines);
+            }
+            Catch (e) {
+                return "invalid number of lines";
+            }
+        }
+        if (argc > 3) {
+            Try {
+                string_to_uint(argv[3], &since);
+            }
+            Catch (e) {
+                return "invalid number of seconds";
+            }
+        }
+
+        // Convert the number of seconds to a time.
+        unsigned long long since_time = 0;
+        if (since > 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            since_time = ((unsigned long long)now.tv_sec - since) * 1000 + now.tv_nsec / 1000000;
+        }
+
+        const char *err = (sid >= 0) ?
+            ctl_reply_service_log(fd, sid, lines, since_time) :
+            ctl_reply_all_services_log(fd, lines, since_time);
+        if (err) {
+            return err;
+        }
+    }
+    else if (strcmp(cmd, "stats") == 0) {
+        unsigned int num_services = 0;
+        unsigned int num_running = 0;
+        unsigned int num_restarts = 0;
+        FOR_EACH_SERVICE(i) {
+            if (SRV(i).disabled || SRV(i).is_service_group) {
+                continue;
+            }
+            num_services++;
+            num_running += (SRV(i).pid != 0);
+            num_restarts += SRV(i).restart_count;
+        }
+        ctl_reply(fd, "uptime=%lu services=%u running=%u restarts=%u",
+                (get_time() - g_ctx.boot_time) / 1000,
+                num_services,
+                num_running,
+                num_restarts);
+    }
+    else if (strcmp(cmd, "metrics") == 0) {
+        write_metrics(fd);
+    }
+    else {
+        return "unknown command";
+    }
+
+    return NULL;
+}
+
+/**
+ * Process pending connections of the control socket.
+ *
+ * @param[in] listen_fd File descriptor of the listening socket.
+ */
+static void process_ctl_requests(int listen_fd)
+{
+    while (true) {
+        char buf[CTL_MAX_REQUEST_LENGTH];
+        char *argv[CTL_MAX_REQUEST_ARGS];
+        int argc = 0;
+
+        int fd = ctl_accept(listen_fd, buf, sizeof(buf), argv, &argc);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_err("could not accept control connection: %s.", strerror(errno));
+            }
+            break;
+        }
+
+        ctl_end(fd, handle_ctl_request(fd, argc, argv));
+    }
+}
+
+/**
+ * Process pending connections of the HTTP metrics endpoint.
+ *
+ * @param[in] listen_fd File descriptor of the listening socket.
+ */
+static void process_metrics_requests(int listen_fd)
+{
+    while (true) {
+        int fd = ctl_http_accept(listen_fd);
+        if (fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            continue;
+        }
+
+        write_metrics(fd);
+        close(fd);
+    }
+}
+
 static void cinit_exit(int status)
 {
+    if (g_ctx.log_store_dir) {
+        logstore_close();
+    }
+    log_flush();
+
     // Replace ourself with the exit script, if it exists.
     if (chdir(SRV_ROOT()) == 0 && access("exit", X_OK) == 0) {
         char arg[FMT_LONG];
@@ -1760,6 +2711,54 @@ static void parse_args(int argc, char *argv[])
             case 'd':
                 g_ctx.debug = true;
                 break;
+            case 'c':
+                g_ctx.ctl_request = optarg;
+                break;
+            case 'M':
+                g_ctx.metrics_address = optarg;
+                break;
+            case 'C':
+                g_ctx.compile = true;
+                break;
+            case 'x':
+                g_ctx.run_stages = true;
+                break;
+            case 'F':
+                if (strcmp(optarg, "text") == 0) {
+                    log_set_format(LOG_FORMAT_TEXT);
+                }
+                else if (strcmp(optarg, "json") == 0) {
+                    log_set_format(LOG_FORMAT_JSON);
+                }
+                else {
+                    ThrowMessage("Invalid log format '%s'.", optarg);
+                }
+                break;
+            case 'L':
+                if (optarg[0] != '/') {
+                    ThrowMessage("Log store directory path must be absolute.");
+                }
+                g_ctx.log_store_dir = optarg;
+                break;
+            case 'q':
+                g_ctx.log_query = optarg;
+                break;
+            case 'f':
+                if (strlen(optarg) >= sizeof(g_ctx.snapshot_path)) {
+                    ThrowMessage("Snapshot file path too long.");
+                }
+                else {
+                    strcpy(g_ctx.snapshot_path, optarg);
+                }
+                break;
+            case 'S':
+                if (strlen(optarg) >= sizeof(g_ctx.ctl_socket_path)) {
+                    ThrowMessage("Control socket path too long.");
+                }
+                else {
+                    strcpy(g_ctx.ctl_socket_path, optarg);
+                }
+                break;
               case 'p':
                 if (strlen(optarg) >= sizeof(g_ctx.progname)) {
                     ThrowMessage("Programme namne too long.");
@@ -1866,19 +2865,165 @@ static void parse_args(int argc, char *argv[])
         }
     }
 
-    if (optind < argc) {
+    // Only the stages mode accepts a command to execute.
+    if (optind < argc && !g_ctx.run_stages) {
         ThrowMessage("Unexpected argument: '%s'.", argv[optind]);
     }
+
+    // By default, the snapshot file is located next to the root directory.
+    if (g_ctx.snapshot_path[0] == '\0') {
+        size_t len = strlen(SRV_ROOT());
+        while (len > 1 && SRV_ROOT()[len - 1] == '/') {
+            len--;
+        }
+        if (len + strlen(SNAPSHOT_DEFAULT_SUFFIX) >= sizeof(g_ctx.snapshot_path)) {
+            ThrowMessage("Snapshot file path too long.");
+        }
+        snprintf(g_ctx.snapshot_path, sizeof(g_ctx.snapshot_path), "%.*s%s",
+                 (int)len, SRV_ROOT(), SNAPSHOT_DEFAULT_SUFFIX);
+    }
+}
+
+/**
+ * Run the container initialization stages and then execute the command.
+ *
+ * This function returns only on error.
+ *
+ * @param[in] argv NULL terminated command to execute once stages are done.
+ *
+ * @return The exit code to use.
+ */
+static int run_stages(char *argv[])
+{
+    int rc;
+
+    // Scripts are executed from the root directory, like the shell
+    // implementation did.
+    if (chdir("/") < 0) {
+        log_err("could not change directory: %s.", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if ((rc = stages_load_env(CONT_ENV_DIR, g_ctx.log_prefix_length)) != 0) {
+        return rc;
+    }
+    else if ((rc = stages_load_secrets(CONT_SECRETS_DIR, g_ctx.log_prefix_length)) != 0) {
+        return rc;
+    }
+    else if ((rc = stages_run_init(CONT_INIT_DIR, g_ctx.log_prefix_length)) != 0) {
+        return rc;
+    }
+
+    if (!argv[0]) {
+        return EXIT_SUCCESS;
+    }
+
+    log_flush();
+    execve(argv[0], argv, environ);
+    log_err("could not execute '%s': %s.", argv[0], strerror(errno));
+    return 126;
+}
+
+/**
+ * Print lines of the log store matching a query.
+ *
+ * The query has the form "SERVICE|* [SINCE [UNTIL]]", where SINCE and UNTIL
+ * are numbers of seconds ago.
+ *
+ * @param[in] query The query.
+ *
+ * @return The exit code to use.
+ */
+static int query_log_store(const char *query)
+{
+    CEXCEPTION_T e;
+
+    char buf[512];
+    size_t argc = 0;
+    char **argv = NULL;
+    unsigned int since = 0;
+    unsigned int until = 0;
+    int retval = EXIT_SUCCESS;
+
+    snprintf(buf, sizeof(buf), "%s", query);
+    argv = split(trim(buf), ' ', &argc, 0, 0);
+    if (!argv) {
+        printf("Could not parse log query.\n");
+        return EXIT_FAILURE;
+    }
+
+    Try {
+        if (argc < 1 || argc > 3 || argv[0][0] == '\0') {
+            ThrowMessage("Invalid log query '%s'.", query);
+        }
+        if (argc > 1) {
+            Try {
+                string_to_uint(argv[1], &since);
+            }
+            Catch (e) {
+                ThrowMessage("Invalid number of seconds '%s': %s.", argv[1], e.mMessage);
+            }
+        }
+        if (argc > 2) {
+            Try {
+                string_to_uint(argv[2], &until);
+            }
+            Catch (e) {
+                ThrowMessage("Invalid number of seconds '%s': %s.", argv[2], e.mMessage);
+            }
+        }
+
+        // Convert the numbers of seconds to times.
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        unsigned long long now_msec = (unsigned long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+        unsigned long long since_time = (since > 0) ? now_msec - since * 1000ULL : 0;
+        unsigned long long until_time = now_msec - until * 1000ULL;
+
+        const char *dir = g_ctx.log_store_dir ? g_ctx.log_store_dir : LOGSTORE_DEFAULT_DIR;
+        const char *service = strcmp(argv[0], "*") == 0 ? NULL : argv[0];
+        if (logstore_query(dir, service, since_time, until_time, stdout) < 0) {
+            ThrowMessage("Could not query log store %s: %s.", dir, strerror(errno));
+        }
+    }
+    Catch (e) {
+        printf("%s\n", e.mMessage);
+        retval = EXIT_FAILURE;
+    }
+
+    free(argv);
+    return retval;
 }
 
 static void usage(const char *progname)
 {
     printf("Usage: %s [OPTIONS...]\n", progname);
+    printf("       %s --run-stages [-- COMMAND [ARGS...]]\n", progname);
     printf("\n");
     printf("Options:\n");
     printf("  -d, --debug                                 Enable debug logging.\n");
     printf("  -p, --progname <NAME>                       Override the name that will be displayed in log messages to NAME.\n");
+    printf("  -c, --control <REQUEST>                     Send REQUEST to the running instance and print its reply.\n"
+           "                                              Requests: status [SERVICE], start SERVICE, stop SERVICE,\n"
+           "                                              restart SERVICE, reload SERVICE, log SERVICE|* [LINES [SECONDS]],\n"
+           "                                              stats, metrics.\n");
+    printf("  -S, --control-socket <PATH>                 Path of the control socket. Default is " CTL_DEFAULT_SOCKET_PATH ".\n");
+    printf("  -M, --metrics-listen <[ADDR:]PORT>          Serve Prometheus metrics over HTTP on PORT. ADDR defaults to\n"
+           "                                              127.0.0.1. Disabled by default.\n");
+    printf("  -F, --log-format <FORMAT>                   Format of log messages: 'text' (default) or 'json'.\n");
+    printf("  -L, --log-store <DIR>                       Append output of services to segment files of DIR, kept\n"
+           "                                              compressed once full. Disabled by default.\n");
+    printf("  -q, --query-log <QUERY>                     Print lines of the log store logged by SERVICE (or all\n"
+           "                                              services) between SINCE and UNTIL seconds ago. QUERY\n"
+           "                                              is 'SERVICE|* [SINCE [UNTIL]]'. The log store directory\n"
+           "                                              is " LOGSTORE_DEFAULT_DIR " unless set by --log-store.\n");
     printf("  -r, --root-directory <DIR>                  Set the root directory to DIR. Default is " SERVICES_DEFAULT_ROOT ".\n");
+    printf("  -C, --compile                               Compile the services configuration snapshot and exit.\n");
+    printf("  -f, --snapshot-file <PATH>                  Path of the services configuration snapshot. Default is the\n"
+           "                                              root directory path followed by '" SNAPSHOT_DEFAULT_SUFFIX "'.\n");
+    printf("  -x, --run-stages                            Load environment variables from " CONT_ENV_DIR " and\n"
+           "                                              " CONT_SECRETS_DIR ", run initialization scripts of\n"
+           "                                              " CONT_INIT_DIR ", then execute COMMAND.\n");
     printf("  -g, --services-gracetime <VALUE>            Set the amount of time (in msec) allowed to\n"
            "                                              services to gracefully terminate before sending\n"
            "                                              the KILL signal to everyone. Default is %d msec.\n", SERVICES_DEFAULT_GRACETIME);
@@ -1899,9 +3044,9 @@ int main(int argc, char *argv[])
 {
     CEXCEPTION_T e;
 
-    int cmd_fd = -1;
+    int ctl_fd = -1;
+    int metrics_fd = -1;
     int exit_status = 0;
-    struct group *grp = NULL;
 
     // Get the program name.
     const char *progname = strrchr(argv[0], '/');
@@ -1918,6 +3063,12 @@ int main(int argc, char *argv[])
         // Parse.
         parse_args(argc, argv);
 
+        // When acting as a client, nothing else to do than sending the
+        // request.
+        if (g_ctx.ctl_request || g_ctx.log_query || g_ctx.run_stages) {
+            ExitTry();
+        }
+
         // Validate.
         if (chdir(SRV_ROOT()) < 0) {
             ThrowMessage("Root directory not found: %s", SRV_ROOT());
@@ -1933,35 +3084,67 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    // Create the named pipe (FIFO).
-    unlink(CMD_FIFO_PATH);
-    if (mkfifo(CMD_FIFO_PATH, 0666) == -1) {
-        printf("Could not create named pipe: %s.\n", strerror(errno));
-        return EXIT_FAILURE;
+    // Send the control request, if we are acting as a client.
+    if (g_ctx.ctl_request) {
+        return ctl_client(g_ctx.ctl_socket_path, g_ctx.ctl_request);
     }
-    else if (!(grp = getgrnam("cinit"))) {
-        printf("Could not get cinit group: %s.\n", strerror(errno));
-        return EXIT_FAILURE;
+
+    // Query the log store, if requested.
+    if (g_ctx.log_query) {
+        return query_log_store(g_ctx.log_query);
     }
-    else if (chown(CMD_FIFO_PATH, 0, grp->gr_gid) == -1) {
-        printf("Could not set group of named pipe: %s.\n", strerror(errno));
-        return EXIT_FAILURE;
+
+    // Run the container initialization stages, if requested.
+    if (g_ctx.run_stages) {
+        g_ctx.log_prefix_length = MAX(MIN_LOG_PREFIX_LENGTH, strlen(g_ctx.progname));
+        return run_stages(&argv[optind]);
+    }
+
+    // Compile the services configuration snapshot, if requested.
+    if (g_ctx.compile) {
+        if (snapshot_compile(SRV_ROOT(), g_ctx.snapshot_path) < 0) {
+            printf("Could not compile services configuration snapshot.\n");
+            return EXIT_FAILURE;
+        }
+        printf("Services configuration snapshot written to %s.\n", g_ctx.snapshot_path);
+        return EXIT_SUCCESS;
     }
-    else if (chmod(CMD_FIFO_PATH, 0660) == -1) {
-        printf("Could not set permissions of named pipe: %s.\n", strerror(errno));
+
+    g_ctx.boot_time = get_time();
+
+    // Create the pipe used to wake up the main loop.
+    if (pipe2(wakeup_pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+        printf("Could not create pipe: %s.\n", strerror(errno));
         return EXIT_FAILURE;
     }
 
-    // Open the named pipe (FIFO).
-    cmd_fd = open(CMD_FIFO_PATH, O_RDONLY | O_NONBLOCK);
-    if (cmd_fd == -1) {
-        printf("Could not create name pipe: %s.\n", strerror(errno));
+    // Create the control socket.
+    ctl_fd = ctl_listen(g_ctx.ctl_socket_path, CTL_SOCKET_GROUP);
+    if (ctl_fd == -1) {
+        printf("Could not create control socket: %s.\n", strerror(errno));
         return EXIT_FAILURE;
     }
 
+    // Create the HTTP metrics endpoint.
+    if (g_ctx.metrics_address) {
+        metrics_fd = ctl_http_listen(g_ctx.metrics_address);
+        if (metrics_fd == -1) {
+            printf("Could not listen on '%s' for metrics: %s.\n", g_ctx.metrics_address, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
     // Update the log prefix length.
     g_ctx.log_prefix_length = MAX(MIN_LOG_PREFIX_LENGTH, strlen(g_ctx.progname));
 
+    // Open the log store.  Services are run without it on failure.
+    if (g_ctx.log_store_dir) {
+        if (logstore_open(g_ctx.log_store_dir, g_ctx.progname, g_ctx.log_prefix_length) < 0) {
+            log_err("could not open log store %s: %s.", g_ctx.log_store_dir, strerror(errno));
+            g_ctx.log_store_dir = NULL;
+        }
+    }
+
     // Initialize start order of services.
     for (int i = 0; i < DIM(g_ctx.start_order); ++i) {
         g_ctx.start_order[i] = -1;
@@ -2005,6 +3188,28 @@ int main(int argc, char *argv[])
         }
     }
 
+    // Setup cgroups, so each service can run in its own.
+    if (cgroup_init() == 0) {
+        g_ctx.cgroup_enabled = true;
+        log_debug("cgroup v2 available, enabled controllers: %s.", cgroup_controllers());
+    }
+    else {
+        log_debug("cgroup v2 not available: %s.", strerror(errno));
+    }
+
+    // Map the services configuration snapshot.  When not usable, services
+    // are loaded from the root directory.
+    if (snapshot_load(g_ctx.snapshot_path, SRV_ROOT()) == 0) {
+        log_debug("using services configuration snapshot %s.", g_ctx.snapshot_path);
+    }
+    else if (errno == ESTALE) {
+        log("services configuration snapshot %s is out of date, ignoring.", g_ctx.snapshot_path);
+    }
+    else if (errno != ENOENT) {
+        log_err("could not load services configuration snapshot %s: %s.",
+                g_ctx.snapshot_path, strerror(errno));
+    }
+
     // Bring up services.
     Try {
         // Load services.
@@ -2014,6 +3219,7 @@ int main(int argc, char *argv[])
 #else
         load_service_with_deps("default", -1);
 #endif
+        snapshot_unload();
         log("all services loaded.");
 
         // Now that all services are known, update the log prefix length.
@@ -2032,6 +3238,7 @@ int main(int argc, char *argv[])
         log("all services started.");
     }
     Catch (e) {
+        snapshot_unload();
         log("%s", e.mMessage);
         exit_status = 1;
         REQUEST_SHUTDOWN();
@@ -2056,7 +3263,7 @@ int main(int argc, char *argv[])
             bool services_to_be_restarted = false;
 
             FOR_EACH_SERVICE(sid) {
-                if ((SRV(sid).respawn || SRV(sid).restart_requested) && SRV(sid).pid == 0) {
+                if (((SRV(sid).respawn && !SRV(sid).stop_requested) || SRV(sid).restart_requested) && SRV(sid).pid == 0) {
                     services_to_be_restarted = true;
                     break;
                 }
@@ -2098,12 +3305,13 @@ int main(int argc, char *argv[])
 
         // Process services that needs to be restarted.
         FOR_EACH_SERVICE(sid) {
-            if ((SRV(sid).respawn || SRV(sid).restart_requested) && SRV(sid).pid == 0) {
+            if (((SRV(sid).respawn && !SRV(sid).stop_requested) || SRV(sid).restart_requested) && SRV(sid).pid == 0) {
                 if (get_time() - SRV(sid).start_time > SERVICE_RESTART_DELAY) {
                     log("restarting service '%s'.", SRV(sid).name);
                     Try {
                         start_service(sid);
                         SRV(sid).restart_requested = false;
+                        SRV(sid).restart_count++;
                     }
                     Catch (e) {
                         log_err("failed to restart service '%s': %s",
@@ -2113,49 +3321,45 @@ int main(int argc, char *argv[])
             }
         }
 
-        // Progress command received from the named pipe.
+        // Wait for an event: a signal, a control request or the next
+        // periodic check.
         {
-            char buf[256];
-            ssize_t len = read(cmd_fd, buf, sizeof(buf) - 1);
-            if (len > 0) {
-                buf[len] = '\0';
-                terminate_at_first_eol(buf);
-                trim(buf);
-
-                // Restart service command.
-                if (strncmp(buf, "restart:", strlen("restart:")) == 0) {
-                    const char *service = buf + strlen("restart:");
-                    int sid = find_service(service);
-                    if (sid >= 0) {
-                        Try {
-                            log("restart request for service '%s' received.", SRV(sid).name);
-                            stop_service(sid);
-                            SRV(sid).restart_requested = true;
-                        }
-                        Catch (e) {
-                            log_err("failed to stop service '%s': %s", SRV(sid).name, e.mMessage);
-                        }
-                    }
-                    else {
-                        log("service not found: '%s'", service);
-                    }
+            struct pollfd pfds[] = {
+                { .fd = wakeup_pipe[0], .events = POLLIN },
+                { .fd = ctl_fd, .events = POLLIN },
+                { .fd = metrics_fd, .events = POLLIN },
+            };
+
+            if (poll(pfds, DIM(pfds), 1000) > 0) {
+                if (pfds[0].revents & POLLIN) {
+                    char buf[64];
+                    while (read(wakeup_pipe[0], buf, sizeof(buf)) > 0);
+                }
+                if (pfds[1].revents & POLLIN) {
+                    process_ctl_requests(ctl_fd);
+                }
+                if (pfds[2].revents & POLLIN) {
+                    process_metrics_requests(metrics_fd);
                 }
             }
         }
+    }
 
-        // Pause for 1 second.
-        msleep(1000);
+    // Logging is not async-signal-safe: report the received signal here.
+    if (shutdown_signal) {
+        log("%s received, shutting down...", signal_to_str(shutdown_signal));
     }
 
     if (exit_status == 0 && g_ctx.exit_code != 0) {
         exit_status = g_ctx.exit_code;
     }
 
-    // Destroy the named pipe (FIFO).
-    if (cmd_fd != -1) {
-        close(cmd_fd);
-    }
-    unlink(CMD_FIFO_PATH);
+    // Destroy the control socket.
+    close_fd(&ctl_fd);
+    unlink(g_ctx.ctl_socket_path);
+
+    // Destroy the HTTP metrics endpoint.
+    close_fd(&metrics_fd);
 
     // Shutdown all services.
     ASSERT_LOG(SHUTDOWN_REQUESTED(), "Performing shutdown without request.");
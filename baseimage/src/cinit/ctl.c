@@ -0,0 +1,327 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <grp.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ctl.h"
+#include "utils.h"
+
+/**
+ * Maximum amount of time (in msec) a client has to send its request or to
+ * receive the reply.
+ */
+#define CTL_IO_TIMEOUT 1000
+
+/**
+ * Fill a Unix socket address.
+ *
+ * @param[out] addr The address to fill.
+ * @param[in] path Path of the socket.
+ *
+ * @return 0 on success, -1 if the path is too long.
+ */
+static int fill_addr(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/**
+ * Set the send and receive timeouts of a socket.
+ *
+ * @param[in] fd File descriptor of the socket.
+ * @param[in] msec Timeout value, in milliseconds.
+ */
+static void set_io_timeout(int fd, unsigned int msec)
+{
+    struct timeval tv = {
+        .tv_sec = msec / 1000,
+        .tv_usec = (msec % 1000) * 1000,
+    };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+int ctl_listen(const char *path, const char *group)
+{
+    struct sockaddr_un addr;
+    struct group *grp = NULL;
+
+    if (fill_addr(&addr, path) < 0) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    errno = 0;
+    if (!(grp = getgrnam(group))) {
+        if (errno == 0) {
+            errno = ENOENT;
+        }
+        close(fd);
+        return -1;
+    }
+    else if (chown(path, 0, grp->gr_gid) < 0 || chmod(path, 0660) < 0) {
+        close(fd);
+        return -1;
+    }
+    else if (listen(fd, 8) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int ctl_accept(int listen_fd, char *buf, size_t bufsize, char *argv[CTL_MAX_REQUEST_ARGS], int *argc)
+{
+    size_t used = 0;
+
+    *argc = 0;
+
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    set_io_timeout(fd, CTL_IO_TIMEOUT);
+
+    // Read the request line.
+    while (used < bufsize - 1) {
+        ssize_t len = read(fd, buf + used, bufsize - used - 1);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            return -1;
+        }
+        else if (len == 0) {
+            break;
+        }
+        used += len;
+        if (memchr(buf + used - len, '\n', len)) {
+            break;
+        }
+    }
+    buf[used] = '\0';
+    terminate_at_first_eol(buf);
+
+    // Split the request into arguments.
+    char *saveptr = NULL;
+    for (char *tok = strtok_r(buf, " \t", &saveptr);
+         tok && *argc < CTL_MAX_REQUEST_ARGS;
+         tok = strtok_r(NULL, " \t", &saveptr)) {
+        argv[(*argc)++] = tok;
+    }
+
+    return fd;
+}
+
+void ctl_reply(int fd, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vdprintf(fd, format, args);
+    va_end(args);
+    dprintf(fd, "\n");
+}
+
+void ctl_end(int fd, const char *error)
+{
+    if (error) {
+        dprintf(fd, "ERROR %s\n", error);
+    }
+    else {
+        dprintf(fd, "OK\n");
+    }
+    close(fd);
+}
+
+int ctl_http_listen(const char *address)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    char host[64] = "";
+    unsigned int port;
+    const char *port_str = strrchr(address, ':');
+
+    // Parse the address.
+    if (port_str) {
+        size_t host_len = port_str - address;
+        if (host_len >= sizeof(host)) {
+            errno = EINVAL;
+            return -1;
+        }
+        memcpy(host, address, host_len);
+        host[host_len] = '\0';
+        port_str++;
+
+        if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    else {
+        port_str = address;
+    }
+
+    char *endptr;
+    port = strtoul(port_str, &endptr, 10);
+    if (*port_str == '\0' || *endptr != '\0' || port == 0 || port > 65535) {
+        errno = EINVAL;
+        return -1;
+    }
+    addr.sin_port = htons(port);
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 8) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int ctl_http_accept(int listen_fd)
+{
+    char buf[1024];
+    size_t used = 0;
+
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    set_io_timeout(fd, CTL_IO_TIMEOUT);
+
+    // Read the request head.  Only the request line matters: the rest is
+    // consumed so the client doesn't get a connection reset.
+    while (used < sizeof(buf) - 1) {
+        ssize_t len = read(fd, buf + used, sizeof(buf) - used - 1);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        else if (len <= 0) {
+            break;
+        }
+        used += len;
+        buf[used] = '\0';
+        if (strstr(buf, "\r\n\r\n") || strstr(buf, "\n\n")) {
+            break;
+        }
+    }
+    buf[used] = '\0';
+
+    if (strncmp(buf, "GET ", 4) != 0) {
+        dprintf(fd, "HTTP/1.0 405 Method Not Allowed\r\n"
+                    "Content-Type: text/plain\r\n"
+                    "Connection: close\r\n"
+                    "\r\n"
+                    "Method not allowed.\n");
+        close(fd);
+        return -1;
+    }
+
+    dprintf(fd, "HTTP/1.0 200 OK\r\n"
+                "Content-Type: text/plain; version=0.0.4\r\n"
+                "Connection: close\r\n"
+                "\r\n");
+    return fd;
+}
+
+int ctl_client(const char *path, const char *request)
+{
+    struct sockaddr_un addr;
+    int retval = 2;
+
+    if (fill_addr(&addr, path) < 0) {
+        fprintf(stderr, "Invalid control socket path: %s.\n", strerror(errno));
+        return 2;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Could not create socket: %s.\n", strerror(errno));
+        return 2;
+    }
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Could not connect to %s: %s.\n", path, strerror(errno));
+        close(fd);
+        return 2;
+    }
+
+    if (dprintf(fd, "%s\n", request) < 0) {
+        fprintf(stderr, "Could not send request: %s.\n", strerror(errno));
+        close(fd);
+        return 2;
+    }
+    shutdown(fd, SHUT_WR);
+
+    // Read the reply.  Every line is printed as it comes, except the final
+    // status line.
+    FILE *f = fdopen(fd, "r");
+    if (!f) {
+        fprintf(stderr, "Could not read reply: %s.\n", strerror(errno));
+        close(fd);
+        return 2;
+    }
+
+    char *line = NULL;
+    size_t linesize = 0;
+    while (getline(&line, &linesize, f) >= 0) {
+        if (strcmp(line, "OK\n") == 0) {
+            retval = 0;
+            break;
+        }
+        else if (strncmp(line, "ERROR ", 6) == 0) {
+            fprintf(stderr, "%s", line + 6);
+            retval = 1;
+            break;
+        }
+        fputs(line, stdout);
+    }
+
+    if (retval == 2) {
+        fprintf(stderr, "Connection closed without status.\n");
+    }
+
+    free(line);
+    fclose(f);
+    return retval;
+}
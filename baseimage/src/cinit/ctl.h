@@ -0,0 +1,113 @@
+#ifndef __CINIT_CTL_H__
+#define __CINIT_CTL_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Control protocol.
+ *
+ * A client connects to the control socket and sends a single request line,
+ * terminated by a newline character:
+ *
+ *   <command> [<argument>...]
+ *
+ * The server answers with zero or more payload lines, followed by a final
+ * status line that is either "OK" or "ERROR <message>".  The connection is
+ * then closed by the server.
+ */
+
+/**
+ * Maximum length of a request line, including the terminating NULL character.
+ */
+#define CTL_MAX_REQUEST_LENGTH 512
+
+/**
+ * Maximum number of arguments a request can have, including the command.
+ */
+#define CTL_MAX_REQUEST_ARGS 8
+
+/**
+ * Create the listening control socket.
+ *
+ * Any existing file at the socket path is removed first.
+ *
+ * @param[in] path Path of the Unix socket.
+ * @param[in] group Name of the group that should own the socket.  The socket
+ *                  is made accessible to this group only.
+ *
+ * @return File descriptor of the listening socket or -1 on error.
+ */
+int ctl_listen(const char *path, const char *group);
+
+/**
+ * Accept a pending control connection and read its request.
+ *
+ * The request line is split in place into arguments.
+ *
+ * @param[in] listen_fd File descriptor of the listening socket.
+ * @param[out] buf Buffer where to store the request line.
+ * @param[in] bufsize Size of the buffer.
+ * @param[out] argv Table receiving pointers to the request arguments.
+ * @param[out] argc Number of arguments stored in the table.
+ *
+ * @return File descriptor of the client connection or -1 on error.
+ */
+int ctl_accept(int listen_fd, char *buf, size_t bufsize, char *argv[CTL_MAX_REQUEST_ARGS], int *argc);
+
+/**
+ * Send a payload line to a control client.
+ *
+ * @param[in] fd File descriptor of the client connection.
+ * @param[in] format Format of the line, without the newline character.
+ * @param[in] ... Argument(s) of the line.
+ */
+void ctl_reply(int fd, const char *format, ...);
+
+/**
+ * Send the final status line to a control client and close the connection.
+ *
+ * @param[in] fd File descriptor of the client connection.
+ * @param[in] error Error message or NULL on success.
+ */
+void ctl_end(int fd, const char *error);
+
+/**
+ * Create a listening TCP socket serving HTTP requests.
+ *
+ * @param[in] address Address to listen on, in the "[ADDR:]PORT" format.  When
+ *                    not specified, ADDR defaults to 127.0.0.1.
+ *
+ * @return File descriptor of the listening socket or -1 on error.
+ */
+int ctl_http_listen(const char *address);
+
+/**
+ * Accept a pending HTTP connection and read its request.
+ *
+ * On a GET request, the header of a successful plain text response is sent
+ * and the caller is expected to write the body before closing the connection.
+ * Other requests are answered with an error.
+ *
+ * @param[in] listen_fd File descriptor of the listening socket.
+ *
+ * @return File descriptor of the client connection, or -1 if there is no
+ *         body to send.
+ */
+int ctl_http_accept(int listen_fd);
+
+/**
+ * Send a request to the control socket and print the reply.
+ *
+ * Payload lines are printed to stdout, while an error status is printed to
+ * stderr.
+ *
+ * @param[in] path Path of the Unix socket.
+ * @param[in] request The request line, without the newline character.
+ *
+ * @return 0 if the request succeeded, 1 if it failed, 2 on communication
+ *         error.
+ */
+int ctl_client(const char *path, const char *request);
+
+#endif // __CINIT_CTL_H__
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdarg.h>
 #include <unistd.h>
 #include <sys/wait.h>
@@ -89,10 +91,10 @@ int exec_cmd_with_line_callback(exec_cmd_line_callback_t callback, void *callbac
     va_end(arguments);
 
     // Create the pipe.
-    if (pipe(stdout_link) != 0) {
+    if (pipe2(stdout_link, O_CLOEXEC) != 0) {
         return -1;
     }
-    else if (pipe(stderr_link) != 0) {
+    else if (pipe2(stderr_link, O_CLOEXEC) != 0) {
         return -1;
     }
 
@@ -329,10 +331,10 @@ int exec_cmd(bool disable_output, const char *output_prefix, const char *cmd, ..
 
     // Create the pipes.
     if (!disable_output) {
-        if (pipe(stdout_link) != 0) {
+        if (pipe2(stdout_link, O_CLOEXEC) != 0) {
             return -1;
         }
-        else if (pipe(stderr_link) != 0) {
+        else if (pipe2(stderr_link, O_CLOEXEC) != 0) {
             close(stdout_link[0]);
             close(stdout_link[1]);
             return -1;
@@ -359,7 +361,14 @@ int exec_cmd(bool disable_output, const char *output_prefix, const char *cmd, ..
             close(stderr_link[1]);
 
             // Read child's output.
-            retval = log_prefixer(output_prefix, stdout_link[0], stderr_link[0], NULL);
+            log_source_t source = {
+                .name = NULL,
+                .prefix = output_prefix,
+                .buffer = NULL,
+                .rate_limit = NULL,
+                .store = false,
+            };
+            retval = log_prefixer(&source, stdout_link[0], stderr_link[0], NULL);
 
             close(stdout_link[0]);
             close(stderr_link[0]);
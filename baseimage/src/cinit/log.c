@@ -1,42 +1,692 @@
+#define _GNU_SOURCE
+
 #include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/uio.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <errno.h>
+#include <string.h>
 
 #include "log.h"
+#include "logstore.h"
 #include "utils.h"
 
 #define STDOUT_IDX 0
 #define STDERR_IDX 1
 
+#define MIN(a, b) ((a)<=(b)?(a):(b))
+
+/**
+ * Number of records of the log ring.  Must be a power of 2.
+ */
+#define LOG_RING_SIZE 512
+
+/**
+ * Size of the data stored directly in a record.  Longer messages are stored
+ * in dynamically allocated memory.
+ */
+#define LOG_RECORD_DATA_SIZE 256
+
+/**
+ * Maximum number of records written with a single writev() call.
+ */
+#define LOG_WRITER_MAX_BATCH 64
+
+/**
+ * Maximum amount of time (in usec) a message can wait before being written.
+ * This gives a chance to messages to be batched.
+ */
+#define LOG_FLUSH_DEADLINE 2000
+
+/**
+ * Maximum amount of time (in usec) a producer waits for a free record when the
+ * ring is full.  After that, the message is dropped.
+ */
+#define LOG_BACKPRESSURE_TIMEOUT 100000
+
+/**
+ * Maximum amount of time (in usec) to wait for pending messages to be written
+ * by log_flush().
+ */
+#define LOG_FLUSH_TIMEOUT 1000000
+
+/**
+ * Header of a line stored in a log buffer.
+ */
+typedef struct {
+    unsigned long long time; /**< Time (in msec since the Epoch) at which the line was logged. */
+    size_t len;              /**< Length of the line. */
+} log_buffer_record_t;
+
+/**
+ * Maximum length of a message, once escaped for the JSON format.  Longer
+ * messages are truncated.
+ */
+#define LOG_JSON_MESSAGE_MAX_LENGTH 8192
+
+/** A preformatted message waiting to be written. */
+typedef struct {
+    atomic_size_t seq;                /**< Sequence number of the record. */
+    int fd;                           /**< File descriptor where to write the message. */
+    size_t len;                       /**< Length of the message. */
+    char *heap;                       /**< Dynamically allocated message, when too big for data. */
+    char data[LOG_RECORD_DATA_SIZE];  /**< The message. */
+} log_record_t;
+
+/**
+ * Multiple producers, single consumer ring of messages.
+ *
+ * Each record has a sequence number indicating its state: a producer can
+ * claim the record at position pos when its sequence is pos, the writer can
+ * write it once its sequence is pos + 1 and releases it by setting its
+ * sequence to pos + LOG_RING_SIZE.
+ */
+typedef struct {
+    log_record_t records[LOG_RING_SIZE];
+    atomic_size_t head;         /**< Next position to be claimed by producers. */
+    atomic_size_t tail;         /**< Next position to be written by the writer. */
+    atomic_bool writer_idle;    /**< Whether or not the writer waits for a wake up. */
+    atomic_uint dropped;        /**< Number of messages dropped since last report. */
+    sem_t wakeup;               /**< Used to wake up the writer. */
+    bool started;               /**< Whether or not the writer thread is running. */
+} log_ring_t;
+
 typedef struct {
     int fds[2];
-    const char *prefix;
+    const log_source_t *source;
     atomic_bool *time_to_exit;
 } log_prefixer_ctx_t;
 
 static pthread_mutex_t g_stdout_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t g_stderr_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+static log_ring_t g_ring;
+static pthread_once_t g_ring_once = PTHREAD_ONCE_INIT;
+
+static log_format_t g_format = LOG_FORMAT_TEXT;
+
+/**
+ * Get the current time of the clock used by sem_timedwait(), offset by the
+ * specified amount of time.
+ *
+ * @param[out] ts Where to store the time.
+ * @param[in] usec Offset, in usec.
+ */
+static void get_deadline(struct timespec *ts, long usec)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += usec / 1000000;
+    ts->tv_nsec += (usec % 1000000) * 1000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+/**
+ * Check if a deadline is reached.
+ *
+ * @param[in] deadline The deadline.
+ *
+ * @return true if the deadline is reached, false otherwise.
+ */
+static bool deadline_reached(const struct timespec *deadline)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec > deadline->tv_sec ||
+           (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+/**
+ * Write all data described by an array of buffers.
+ *
+ * @param[in] fd File descriptor where to write.
+ * @param[in,out] iov Array of buffers.  It is modified on partial writes.
+ * @param[in] iovcnt Number of buffers.
+ */
+static void writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // Nothing we can do if we can't log.
+            return;
+        }
+
+        // Skip data that has been written.
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+/**
+ * Write records of the ring, from the tail to the specified position.
+ *
+ * Consecutive records for the same file descriptor are written with a single
+ * writev() call.  Records are released once written.
+ *
+ * @param[in] end Position of the first record not to be written.
+ */
+static void log_ring_write(size_t end)
+{
+    struct iovec iov[LOG_WRITER_MAX_BATCH];
+    size_t tail = atomic_load_explicit(&g_ring.tail, memory_order_relaxed);
+    size_t pos = tail;
+
+    while (pos != end) {
+        int fd = g_ring.records[pos & (LOG_RING_SIZE - 1)].fd;
+        int iovcnt = 0;
+
+        while (pos != end && iovcnt < LOG_WRITER_MAX_BATCH) {
+            log_record_t *rec = &g_ring.records[pos & (LOG_RING_SIZE - 1)];
+            if (rec->fd != fd) {
+                break;
+            }
+            iov[iovcnt].iov_base = rec->heap ? rec->heap : rec->data;
+            iov[iovcnt].iov_len = rec->len;
+            iovcnt++;
+            pos++;
+        }
+
+        writev_all(fd, iov, iovcnt);
+    }
+
+    // Release records.
+    for (; tail != end; tail++) {
+        log_record_t *rec = &g_ring.records[tail & (LOG_RING_SIZE - 1)];
+        free(rec->heap);
+        rec->heap = NULL;
+        atomic_store_explicit(&rec->seq, tail + LOG_RING_SIZE, memory_order_release);
+    }
+    atomic_store_explicit(&g_ring.tail, end, memory_order_release);
+}
+
+/**
+ * Get the position following the last record ready to be written.
+ *
+ * @param[in] pos Position from which to start the search.
+ * @param[in] max Maximum number of records to consider.
+ *
+ * @return The position.
+ */
+static size_t log_ring_ready(size_t pos, size_t max)
+{
+    for (size_t i = 0; i < max; i++, pos++) {
+        log_record_t *rec = &g_ring.records[pos & (LOG_RING_SIZE - 1)];
+        if (atomic_load_explicit(&rec->seq, memory_order_acquire) != pos + 1) {
+            break;
+        }
+    }
+    return pos;
+}
+
+/**
+ * Thread writing messages of the log ring.
+ */
+static void *log_writer(void *arg)
+{
+    struct timespec deadline;
+
+    get_deadline(&deadline, LOG_FLUSH_DEADLINE);
+
+    while (true) {
+        size_t tail = atomic_load_explicit(&g_ring.tail, memory_order_relaxed);
+        size_t end = log_ring_ready(tail, LOG_WRITER_MAX_BATCH);
+
+        if (end == tail) {
+            // Nothing to write: report dropped messages, if any.
+            unsigned int dropped = atomic_exchange(&g_ring.dropped, 0);
+            if (dropped > 0) {
+                dprintf(STDERR_FILENO, "%u log message(s) dropped.\n", dropped);
+            }
+
+            // Wait for new messages.  Check again after announcing that we
+            // are idle, since a producer may have missed it.
+            atomic_store(&g_ring.writer_idle, true);
+            if (log_ring_ready(tail, 1) == tail) {
+                while (sem_wait(&g_ring.wakeup) < 0 && errno == EINTR);
+            }
+            atomic_store(&g_ring.writer_idle, false);
+
+            // Give a chance to other messages to be batched with this one.
+            get_deadline(&deadline, LOG_FLUSH_DEADLINE);
+            continue;
+        }
+
+        // Wait for more messages, up to the deadline, unless the batch is
+        // already full.
+        if (end - tail < LOG_WRITER_MAX_BATCH && !deadline_reached(&deadline)) {
+            atomic_store(&g_ring.writer_idle, true);
+            while (sem_timedwait(&g_ring.wakeup, &deadline) < 0 && errno == EINTR);
+            atomic_store(&g_ring.writer_idle, false);
+            end = log_ring_ready(tail, LOG_WRITER_MAX_BATCH);
+            if (end - tail < LOG_WRITER_MAX_BATCH && !deadline_reached(&deadline)) {
+                continue;
+            }
+        }
+
+        log_ring_write(end);
+        get_deadline(&deadline, LOG_FLUSH_DEADLINE);
+    }
+
+    return NULL;
+}
+
+/**
+ * Wake up the writer, if it waits for new messages.
+ */
+static void log_writer_wakeup()
+{
+    if (atomic_exchange(&g_ring.writer_idle, false)) {
+        sem_post(&g_ring.wakeup);
+    }
+}
+
+/**
+ * Start the writer thread.
+ *
+ * On failure, messages are written directly by producers.
+ */
+static void log_writer_start()
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+    sigset_t set, oldset;
+
+    for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+        atomic_init(&g_ring.records[i].seq, i);
+    }
+    atomic_init(&g_ring.head, 0);
+    atomic_init(&g_ring.tail, 0);
+    atomic_init(&g_ring.writer_idle, false);
+    atomic_init(&g_ring.dropped, 0);
+    if (sem_init(&g_ring.wakeup, 0, 0) < 0) {
+        return;
+    }
+
+    // Signals are handled by the main thread.
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    g_ring.started = (pthread_create(&thread, &attr, log_writer, NULL) == 0);
+    pthread_attr_destroy(&attr);
+
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    if (g_ring.started) {
+        atexit(log_flush);
+    }
+}
+
+/**
+ * Queue a message to be written.
+ *
+ * @param[in] fd File descriptor where to write the message.
+ * @param[in] format Format of the message.
+ * @param[in] args Argument(s) for the message.
+ */
+static void log_write(int fd, const char *format, va_list args)
+{
+    char data[LOG_RECORD_DATA_SIZE];
+    char *heap = NULL;
+    va_list args_copy;
+
+    pthread_once(&g_ring_once, log_writer_start);
+
+    // Write directly if the writer is not running.
+    if (!g_ring.started) {
+        pthread_mutex_t *mutex = (fd == STDOUT_FILENO) ? &g_stdout_mutex : &g_stderr_mutex;
+        pthread_mutex_lock(mutex);
+        vdprintf(fd, format, args);
+        pthread_mutex_unlock(mutex);
+        return;
+    }
+
+    // Format the message.
+    va_copy(args_copy, args);
+    int len = vsnprintf(data, sizeof(data), format, args_copy);
+    va_end(args_copy);
+    if (len < 0) {
+        return;
+    }
+    else if (len >= sizeof(data)) {
+        heap = malloc(len + 1);
+        if (heap) {
+            vsnprintf(heap, len + 1, format, args);
+        }
+        else {
+            // Keep the truncated message.
+            len = sizeof(data) - 1;
+        }
+    }
+
+    // Claim a record.
+    log_record_t *rec = NULL;
+    size_t pos = atomic_load_explicit(&g_ring.head, memory_order_relaxed);
+    struct timespec deadline;
+    bool waiting = false;
+
+    while (true) {
+        rec = &g_ring.records[pos & (LOG_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&g_ring.head, &pos, pos + 1,
+                        memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            // The ring is full: wait for the writer to release records, up
+            // to the backpressure timeout.
+            if (!waiting) {
+                get_deadline(&deadline, LOG_BACKPRESSURE_TIMEOUT);
+                waiting = true;
+            }
+            else if (deadline_reached(&deadline)) {
+                atomic_fetch_add(&g_ring.dropped, 1);
+                free(heap);
+                return;
+            }
+            log_writer_wakeup();
+            nanosleep(&(struct timespec){ .tv_sec = 0, .tv_nsec = 100000 }, NULL);
+            pos = atomic_load_explicit(&g_ring.head, memory_order_relaxed);
+        }
+        else {
+            pos = atomic_load_explicit(&g_ring.head, memory_order_relaxed);
+        }
+    }
+
+    // Fill and publish the record.
+    rec->fd = fd;
+    rec->len = len;
+    rec->heap = heap;
+    if (!heap) {
+        memcpy(rec->data, data, len);
+    }
+    atomic_store_explicit(&rec->seq, pos + 1, memory_order_release);
+
+    log_writer_wakeup();
+}
+
+void log_stdout(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    log_write(STDOUT_FILENO, format, args);
+    va_end(args);
+}
+
+void log_stderr(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    log_write(STDERR_FILENO, format, args);
+    va_end(args);
+}
+
+/**
+ * Queue a message to be written.
+ *
+ * @param[in] fd File descriptor where to write the message.
+ * @param[in] format Format of the message.
+ * @param[in] ... Argument(s) for the message.
+ */
+static void log_fd(int fd, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    log_write(fd, format, args);
+    va_end(args);
+}
+
+/**
+ * Escape a string to be included in a JSON document.
+ *
+ * The result is truncated if the destination buffer is too small.
+ *
+ * @param[out] dst Buffer where to store the escaped string.
+ * @param[in] size Size of the destination buffer.
+ * @param[in] src The string to escape.
+ */
+static void json_escape(char *dst, size_t size, const char *src)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t i = 0;
+
+    for (const unsigned char *p = (const unsigned char *)src; *p; p++) {
+        char esc = 0;
+        switch (*p) {
+            case '"':  esc = '"';  break;
+            case '\\': esc = '\\'; break;
+            case '\b': esc = 'b';  break;
+            case '\f': esc = 'f';  break;
+            case '\n': esc = 'n';  break;
+            case '\r': esc = 'r';  break;
+            case '\t': esc = 't';  break;
+        }
+
+        if (esc) {
+            if (i + 2 >= size) break;
+            dst[i++] = '\\';
+            dst[i++] = esc;
+        }
+        else if (*p < 0x20) {
+            if (i + 6 >= size) break;
+            dst[i++] = '\\';
+            dst[i++] = 'u';
+            dst[i++] = '0';
+            dst[i++] = '0';
+            dst[i++] = hex[*p >> 4];
+            dst[i++] = hex[*p & 0xf];
+        }
+        else {
+            if (i + 1 >= size) break;
+            dst[i++] = *p;
+        }
+    }
+    dst[i] = '\0';
+}
+
+/**
+ * Log a line of a source.
+ *
+ * @param[in] fd File descriptor where to write the line.
+ * @param[in] name Name of the source, used by the JSON format.  Can be NULL.
+ * @param[in] prefix Prefix of the line, used by the text format.
+ * @param[in] line The line.
+ */
+static void log_line(int fd, const char *name, const char *prefix, const char *line)
+{
+    if (g_format == LOG_FORMAT_JSON) {
+        char timestamp[32];
+        char escaped_name[512];
+        char escaped_line[LOG_JSON_MESSAGE_MAX_LENGTH];
+        struct timespec now;
+        struct tm tm;
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        gmtime_r(&now.tv_sec, &tm);
+        size_t len = strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &tm);
+        snprintf(timestamp + len, sizeof(timestamp) - len, ".%03ldZ", now.tv_nsec / 1000000);
+
+        json_escape(escaped_name, sizeof(escaped_name), name ? name : "");
+        json_escape(escaped_line, sizeof(escaped_line), line);
+
+        log_fd(fd, "{\"time\":\"%s\",\"service\":\"%s\",\"stream\":\"%s\",\"message\":\"%s\"}\n",
+                timestamp,
+                escaped_name,
+                fd == STDERR_FILENO ? "stderr" : "stdout",
+                escaped_line);
+    }
+    else {
+        log_fd(fd, "%s%s\n", prefix ? prefix : "", line);
+    }
+}
+
+void log_set_format(log_format_t format)
+{
+    g_format = format;
+}
+
+void log_message(const char *source, int prefix_length, bool error, const char *format, ...)
+{
+    int fd = error ? STDERR_FILENO : STDOUT_FILENO;
+    char message[LOG_JSON_MESSAGE_MAX_LENGTH];
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    if (g_format == LOG_FORMAT_JSON) {
+        log_line(fd, source, NULL, message);
+    }
+    else if (source) {
+        log_fd(fd, "[%-*s] %s\n", prefix_length, source, message);
+    }
+    else {
+        log_fd(fd, "%s\n", message);
+    }
+}
+
+void log_flush()
+{
+    if (!g_ring.started) {
+        return;
+    }
+
+    struct timespec deadline;
+    size_t head = atomic_load(&g_ring.head);
+    get_deadline(&deadline, LOG_FLUSH_TIMEOUT);
+
+    // Wait for the writer to catch up.  Records are written on the deadline
+    // at the latest, so no need to force it.
+    while ((intptr_t)(atomic_load(&g_ring.tail) - head) < 0 && !deadline_reached(&deadline)) {
+        log_writer_wakeup();
+        nanosleep(&(struct timespec){ .tv_sec = 0, .tv_nsec = 200000 }, NULL);
+    }
+}
+
+/**
+ * Get the monotonic time.
+ *
+ * @return Time in msec.
+ */
+static unsigned long get_time_msec()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+}
+
+void log_rate_limit_init(log_rate_limit_t *rate_limit, unsigned int rate, unsigned int burst)
+{
+    rate_limit->rate = rate;
+    rate_limit->burst = (burst > 0) ? burst : rate;
+    rate_limit->tokens = rate_limit->burst * 1000UL;
+    rate_limit->last_refill = get_time_msec();
+    rate_limit->suppressed = 0;
+    atomic_init(&rate_limit->total_suppressed, 0);
+}
+
+/**
+ * Take a token from the bucket of a rate limit.
+ *
+ * @param[in] rate_limit The rate limit.
+ *
+ * @return true if a token was available, false otherwise.
+ */
+static bool log_rate_limit_take(log_rate_limit_t *rate_limit)
+{
+    unsigned long now = get_time_msec();
+
+    // Tokens are counted in thousandths of line: at a rate of N lines per
+    // second, N thousandths are earned every msec.
+    rate_limit->tokens += (now - rate_limit->last_refill) * rate_limit->rate;
+    rate_limit->tokens = MIN(rate_limit->tokens, rate_limit->burst * 1000UL);
+    rate_limit->last_refill = now;
+
+    if (rate_limit->tokens < 1000) {
+        return false;
+    }
+    rate_limit->tokens -= 1000;
+    return true;
+}
+
+/**
+ * Log the number of lines suppressed by the rate limit of a source, if any.
+ *
+ * @param[in] ctx The log prefixer context.
+ */
+static void log_prefixer_report_suppressed(log_prefixer_ctx_t *ctx)
+{
+    log_rate_limit_t *rate_limit = ctx->source->rate_limit;
+
+    if (rate_limit && rate_limit->suppressed > 0) {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "%lu line(s) suppressed.", rate_limit->suppressed);
+        log_line(STDERR_FILENO, ctx->source->name, ctx->source->prefix, msg);
+        rate_limit->suppressed = 0;
+    }
+}
+
 static void log_prefixer_callback(int fd, const char *line, void *data)
 {
     log_prefixer_ctx_t *ctx = (log_prefixer_ctx_t *)data;
-    const char *prefix = ctx->prefix ? ctx->prefix : "";
+    const log_source_t *source = ctx->source;
+    const char *prefix = source->prefix;
 
     // If line starts with ':::', do not add the prefix.
     if (line[0] == ':' && line[1] == ':' && line[2] == ':') {
-        prefix = "";
+        prefix = NULL;
         line += 3;
     }
 
+    // The buffer keeps all lines, including suppressed ones.
+    if (source->buffer) {
+        log_buffer_append(source->buffer, line);
+    }
+
+    if (source->rate_limit && source->rate_limit->rate > 0) {
+        if (!log_rate_limit_take(source->rate_limit)) {
+            source->rate_limit->suppressed++;
+            atomic_fetch_add(&source->rate_limit->total_suppressed, 1);
+            return;
+        }
+        log_prefixer_report_suppressed(ctx);
+    }
+
+    if (source->store) {
+        logstore_append(source->name, fd == ctx->fds[STDERR_IDX], line);
+    }
+
     if (fd == ctx->fds[STDOUT_IDX]) {
-        log_stdout("%s%s\n", prefix, line);
+        log_line(STDOUT_FILENO, source->name, prefix, line);
     }
     else if (fd == ctx->fds[STDERR_IDX]) {
-        log_stderr("%s%s\n", prefix, line);
+        log_line(STDERR_FILENO, source->name, prefix, line);
     }
     else {
         assert(!"Unexpected file descriptor.");
@@ -46,40 +696,186 @@ static void log_prefixer_callback(int fd, const char *line, void *data)
 static bool log_prefixer_exit_callback(void *data)
 {
     log_prefixer_ctx_t *ctx = (log_prefixer_ctx_t *)data;
+    log_rate_limit_t *rate_limit = ctx->source->rate_limit;
+
+    // Report suppressed lines once the source has been quiet for a while.
+    if (rate_limit && rate_limit->suppressed > 0 &&
+        get_time_msec() - rate_limit->last_refill >= 1000) {
+        log_prefixer_report_suppressed(ctx);
+    }
+
     return atomic_load(ctx->time_to_exit);
 }
 
-void log_stdout(const char *format, ...)
+int log_prefixer(const log_source_t *source, int stdout_fd, int stderr_fd, atomic_bool *time_to_exit)
 {
-    pthread_mutex_lock(&g_stdout_mutex);
+    log_prefixer_ctx_t ctx = {
+        { stdout_fd, stderr_fd },
+        source,
+        time_to_exit,
+    };
 
-    va_list args;
-    va_start(args, format);
-    vdprintf(STDOUT_FILENO, format, args);
-    va_end(args);
+    int retval = read_lines(ctx.fds, DIM(ctx.fds), log_prefixer_callback, time_to_exit ? log_prefixer_exit_callback : NULL, &ctx);
+    log_prefixer_report_suppressed(&ctx);
+    return retval;
+}
 
-    pthread_mutex_unlock(&g_stdout_mutex);
+int log_buffer_init(log_buffer_t *buffer, size_t size)
+{
+    memset(buffer, 0, sizeof(*buffer));
+    buffer->data = malloc(size);
+    if (!buffer->data) {
+        return -1;
+    }
+    buffer->size = size;
+    pthread_mutex_init(&buffer->lock, NULL);
+    return 0;
 }
 
-void log_stderr(const char *format, ...)
+void log_buffer_free(log_buffer_t *buffer)
 {
-    pthread_mutex_lock(&g_stderr_mutex);
+    if (buffer->data) {
+        pthread_mutex_destroy(&buffer->lock);
+        free(buffer->data);
+        buffer->data = NULL;
+    }
+}
 
-    va_list args;
-    va_start(args, format);
-    vdprintf(STDERR_FILENO, format, args);
-    va_end(args);
+/**
+ * Copy data to a log buffer.
+ *
+ * NOTE: The buffer's mutex must be locked.
+ *
+ * @param[in] buffer The log buffer.
+ * @param[in] pos Absolute position where to write.
+ * @param[in] data Data to write.
+ * @param[in] len Length of the data.
+ */
+static void log_buffer_copy_to(log_buffer_t *buffer, size_t pos, const void *data, size_t len)
+{
+    size_t ofs = pos % buffer->size;
+    size_t first = MIN(len, buffer->size - ofs);
+    memcpy(buffer->data + ofs, data, first);
+    memcpy(buffer->data, (const char *)data + first, len - first);
+}
 
-    pthread_mutex_unlock(&g_stderr_mutex);
+/**
+ * Copy data from a log buffer.
+ *
+ * NOTE: The buffer's mutex must be locked.
+ *
+ * @param[in] buffer The log buffer.
+ * @param[in] pos Absolute position where to read.
+ * @param[out] data Where to copy the data.
+ * @param[in] len Length of the data.
+ */
+static void log_buffer_copy_from(log_buffer_t *buffer, size_t pos, void *data, size_t len)
+{
+    size_t ofs = pos % buffer->size;
+    size_t first = MIN(len, buffer->size - ofs);
+    memcpy(data, buffer->data + ofs, first);
+    memcpy((char *)data + first, buffer->data, len - first);
 }
 
-int log_prefixer(const char *prefix, int stdout_fd, int stderr_fd, atomic_bool *time_to_exit)
+void log_buffer_append(log_buffer_t *buffer, const char *line)
 {
-    log_prefixer_ctx_t ctx = {
-        { stdout_fd, stderr_fd },
-        prefix,
-        time_to_exit,
-    };
+    log_buffer_record_t rec;
+    struct timespec now;
 
-    return read_lines(ctx.fds, DIM(ctx.fds), log_prefixer_callback, time_to_exit ? log_prefixer_exit_callback : NULL, &ctx);
+    if (!buffer->data) {
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    rec.time = (unsigned long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    rec.len = MIN(strlen(line), buffer->size - sizeof(rec));
+
+    pthread_mutex_lock(&buffer->lock);
+
+    // Drop the oldest records until there is enough room.
+    while (buffer->written + sizeof(rec) + rec.len - buffer->oldest > buffer->size) {
+        log_buffer_record_t oldest;
+        log_buffer_copy_from(buffer, buffer->oldest, &oldest, sizeof(oldest));
+        buffer->oldest += sizeof(oldest) + oldest.len;
+    }
+
+    log_buffer_copy_to(buffer, buffer->written, &rec, sizeof(rec));
+    log_buffer_copy_to(buffer, buffer->written + sizeof(rec), line, rec.len);
+    buffer->written += sizeof(rec) + rec.len;
+
+    pthread_mutex_unlock(&buffer->lock);
+}
+
+/**
+ * Format a timestamp.
+ *
+ * @param[out] buf Where to store the formatted timestamp.  Must be at least
+ *                 LOG_BUFFER_TIMESTAMP_LENGTH + 1 bytes.
+ * @param[in] time The timestamp, in msec since the Epoch.
+ */
+static void format_timestamp(char *buf, unsigned long long time)
+{
+    struct tm tm;
+    time_t sec = time / 1000;
+
+    gmtime_r(&sec, &tm);
+    size_t len = strftime(buf, LOG_BUFFER_TIMESTAMP_LENGTH + 1, "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(buf + len, LOG_BUFFER_TIMESTAMP_LENGTH + 1 - len, ".%03uZ", (unsigned int)(time % 1000));
+}
+
+char *log_buffer_tail(log_buffer_t *buffer, unsigned int max_lines, unsigned long long since, bool timestamps)
+{
+    log_buffer_record_t rec;
+    size_t pos;
+    char *copy = NULL;
+    char *p;
+
+    if (!buffer->data) {
+        return strdup("");
+    }
+
+    pthread_mutex_lock(&buffer->lock);
+
+    // Count the matching records.
+    unsigned int num_matching = 0;
+    for (pos = buffer->oldest; pos != buffer->written; pos += sizeof(rec) + rec.len) {
+        log_buffer_copy_from(buffer, pos, &rec, sizeof(rec));
+        num_matching += (rec.time >= since);
+    }
+
+    // Skip the oldest ones, to keep only the requested number of lines.
+    unsigned int num_to_skip = 0;
+    if (max_lines > 0 && num_matching > max_lines) {
+        num_to_skip = num_matching - max_lines;
+    }
+
+    // Copy the lines.
+    copy = malloc(buffer->written - buffer->oldest + (num_matching - num_to_skip) * (LOG_BUFFER_TIMESTAMP_LENGTH + 2) + 1);
+    p = copy;
+    for (pos = buffer->oldest; copy && pos != buffer->written; pos += sizeof(rec) + rec.len) {
+        log_buffer_copy_from(buffer, pos, &rec, sizeof(rec));
+        if (rec.time < since) {
+            continue;
+        }
+        else if (num_to_skip > 0) {
+            num_to_skip--;
+            continue;
+        }
+
+        if (timestamps) {
+            format_timestamp(p, rec.time);
+            p += LOG_BUFFER_TIMESTAMP_LENGTH;
+            *p++ = ' ';
+        }
+        log_buffer_copy_from(buffer, pos + sizeof(rec), p, rec.len);
+        p += rec.len;
+        *p++ = '\n';
+    }
+
+    pthread_mutex_unlock(&buffer->lock);
+
+    if (copy) {
+        *p = '\0';
+    }
+    return copy;
 }
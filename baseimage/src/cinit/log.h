@@ -2,11 +2,85 @@
 #define __CINIT_LOG_H__
 
 #include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/**
+ * Format of log messages.
+ */
+typedef enum {
+    LOG_FORMAT_TEXT = 0, /**< Text lines, prefixed with the name of their source. */
+    LOG_FORMAT_JSON,     /**< One JSON object per line. */
+} log_format_t;
+
+/**
+ * Length of timestamps added to lines by log_buffer_tail().
+ */
+#define LOG_BUFFER_TIMESTAMP_LENGTH 24
+
+/**
+ * Buffer keeping the most recent output of a service.
+ *
+ * Lines are stored, with the time at which they were logged, in a fixed-size
+ * circular buffer: when full, the oldest lines are dropped.  Appending a line
+ * doesn't allocate memory.
+ */
+typedef struct {
+    pthread_mutex_t lock; /**< Protects concurrent accesses to the buffer. */
+    char *data;           /**< The circular buffer. */
+    size_t size;          /**< Size of the circular buffer. */
+    size_t oldest;        /**< Absolute position of the oldest line. */
+    size_t written;       /**< Total number of bytes written to the buffer. */
+} log_buffer_t;
+
+/**
+ * Token bucket limiting the rate of lines of a source.
+ */
+typedef struct {
+    unsigned int rate;             /**< Sustained rate, in lines per second.  0 means unlimited. */
+    unsigned int burst;            /**< Maximum number of lines logged in a burst. */
+    unsigned long tokens;          /**< Available tokens, in thousandths of line. */
+    unsigned long last_refill;     /**< Time (in msec) at which tokens have been refilled. */
+    unsigned long suppressed;      /**< Number of lines suppressed since the last report. */
+    atomic_ulong total_suppressed; /**< Total number of lines suppressed. */
+} log_rate_limit_t;
+
+/**
+ * Source of lines handled by the log prefixer.
+ */
+typedef struct {
+    const char *name;             /**< Name of the source, used by the JSON format.  Can be NULL. */
+    const char *prefix;           /**< Prefix added to lines, used by the text format.  Can be NULL. */
+    log_buffer_t *buffer;         /**< Optional buffer where to keep a copy of the lines. */
+    log_rate_limit_t *rate_limit; /**< Optional rate limit of the lines. */
+    bool store;                   /**< Whether or not to append lines to the log store. */
+} log_source_t;
+
+/**
+ * Set the format of messages logged by log_message() and the log prefixer.
+ *
+ * @param[in] format The format.
+ */
+void log_set_format(log_format_t format);
+
+/**
+ * Log a message of a source, using the configured format.
+ *
+ * @param[in] source Name of the source.  With the text format, the message is
+ *                   prefixed with it.  Can be NULL.
+ * @param[in] prefix_length Minimum length of the prefix.
+ * @param[in] error Whether to log to stderr instead of stdout.
+ * @param[in] format Format of the message, without the newline.
+ * @param[in] ... Argument(s) for the message.
+ */
+void log_message(const char *source, int prefix_length, bool error, const char *format, ...);
 
 /**
  * Log to stdout.
  *
- * This function protects concurrent accesses to stdout with mutex.
+ * Messages are queued and written in batches by a dedicated thread.  The order
+ * of messages is preserved.
  *
  * @param[in] format Format of the message to be logged.
  * @param[in] ... Argument(s) for the message.
@@ -16,7 +90,8 @@ void log_stdout(const char *format, ...);
 /**
  * Log to stderr.
  *
- * This function protects concurrent accesses to stderr with mutex.
+ * Messages are queued and written in batches by a dedicated thread.  The order
+ * of messages is preserved.
  *
  * @param[in] format Format of the message to be logged.
  * @param[in] ... Argument(s) for the message.
@@ -24,15 +99,73 @@ void log_stdout(const char *format, ...);
 void log_stderr(const char *format, ...);
 
 /**
- * Read from file descriptors and append prefix before logging to stdout/stderr.
+ * Wait for queued messages to be written.
  *
- * @param[in] prefix Prefix to be added.
+ * This should be called before replacing the process image or exiting without
+ * calling exit().
+ */
+void log_flush();
+
+/**
+ * Read from file descriptors and log lines using the configured format.
+ *
+ * @param[in] source Source of the lines.
  * @param[in] stdout_fd File descriptor associated to stdout.
  * @param[in] stderr_fd File descriptor associated to stderr.
  * @param[in] time_to_exit Pointer to boolean indicating if it's time to stop.
  *
  * @return -1 if an error occurred, 0 otherwise.
  */
-int log_prefixer(const char *prefix, int stdout_fd, int stderr_fd, atomic_bool *time_to_exit);
+int log_prefixer(const log_source_t *source, int stdout_fd, int stderr_fd, atomic_bool *time_to_exit);
+
+/**
+ * Initialize a rate limit.
+ *
+ * @param[in] rate_limit The rate limit to initialize.
+ * @param[in] rate Sustained rate, in lines per second.  0 means unlimited.
+ * @param[in] burst Maximum number of lines logged in a burst.  0 means the
+ *                  same as the rate.
+ */
+void log_rate_limit_init(log_rate_limit_t *rate_limit, unsigned int rate, unsigned int burst);
+
+/**
+ * Initialize a log buffer.
+ *
+ * @param[in] buffer The log buffer to initialize.
+ * @param[in] size Size of the log buffer, in bytes.
+ *
+ * @return -1 if memory allocation failed, 0 otherwise.
+ */
+int log_buffer_init(log_buffer_t *buffer, size_t size);
+
+/**
+ * Release resources associated to a log buffer.
+ *
+ * @param[in] buffer The log buffer.
+ */
+void log_buffer_free(log_buffer_t *buffer);
+
+/**
+ * Append a line to a log buffer.
+ *
+ * @param[in] buffer The log buffer.
+ * @param[in] line The line to append, without the newline character.
+ */
+void log_buffer_append(log_buffer_t *buffer, const char *line);
+
+/**
+ * Get a copy of the last lines of a log buffer.
+ *
+ * @param[in] buffer The log buffer.
+ * @param[in] max_lines Maximum number of lines to return, 0 for all lines.
+ * @param[in] since Only return lines logged at or after this time (in msec
+ *                  since the Epoch).
+ * @param[in] timestamps Whether or not to prefix lines with the UTC time at
+ *                       which they were logged (ISO 8601 format).
+ *
+ * @return Dynamically allocated, NULL terminated string containing the lines
+ *         or NULL if memory allocation failed.
+ */
+char *log_buffer_tail(log_buffer_t *buffer, unsigned int max_lines, unsigned long long since, bool timestamps);
 
 #endif // __CINIT_LOG_H__
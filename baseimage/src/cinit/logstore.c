@@ -0,0 +1,883 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "logstore.h"
+#include "log.h"
+
+extern char **environ;
+
+#define LOGSTORE_MAGIC "CINITLOG"
+#define LOGSTORE_VERSION 1
+
+/**
+ * Maximum size of the data of a segment.
+ */
+#ifndef LOGSTORE_SEGMENT_DATA_SIZE
+#define LOGSTORE_SEGMENT_DATA_SIZE (4 * 1024 * 1024)
+#endif
+
+/**
+ * Maximum number of segments kept, including the active one.
+ */
+#ifndef LOGSTORE_MAX_SEGMENTS
+#define LOGSTORE_MAX_SEGMENTS 32
+#endif
+
+/**
+ * Amount of data covered by an index entry.
+ */
+#define LOGSTORE_INDEX_INTERVAL (16 * 1024)
+
+/**
+ * Maximum number of services having lines in a segment.  A new segment is
+ * started when the table of services is full.
+ */
+#define LOGSTORE_MAX_SERVICES 64
+
+/**
+ * Size of a service name in the table of services, including the terminating
+ * NUL character.  Longer names are truncated.
+ */
+#define LOGSTORE_SERVICE_NAME_SIZE 64
+
+/**
+ * Maximum length of a stored line.  Longer lines are truncated.
+ */
+#define LOGSTORE_MAX_LINE_LENGTH 16384
+
+/**
+ * Maximum size of a decompressed segment.
+ */
+#define LOGSTORE_MAX_SEGMENT_SIZE (LOGSTORE_SEGMENT_SIZE + 4096)
+
+#define ALIGN(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+#define MIN(a, b) ((a)<=(b)?(a):(b))
+
+/** Header of a segment. */
+typedef struct {
+    char magic[8];               /**< LOGSTORE_MAGIC. */
+    uint32_t version;            /**< LOGSTORE_VERSION. */
+    uint32_t num_services;       /**< Number of services in the table. */
+    uint64_t first_time;         /**< Time of the first record. */
+    uint64_t last_time;          /**< Time of the last record. */
+    uint64_t data_size;          /**< Number of bytes of records. */
+    uint64_t num_index_entries;  /**< Number of entries of the index. */
+    char services[LOGSTORE_MAX_SERVICES][LOGSTORE_SERVICE_NAME_SIZE]; /**< Table of services. */
+} logstore_header_t;
+
+/** Entry of the sparse index of a segment. */
+typedef struct {
+    uint64_t time;     /**< Time of the first record of the block. */
+    uint64_t offset;   /**< Offset of the first record of the block, relative to the data. */
+    uint64_t services; /**< Bitmap of services having lines in the block. */
+} logstore_index_entry_t;
+
+/** Header of a record, followed by the line padded to 8 bytes. */
+typedef struct {
+    uint64_t time;    /**< Time (in msec since the Epoch) at which the line was logged. */
+    uint32_t len;     /**< Length of the line. */
+    uint8_t service;  /**< Index of the service in the table of services. */
+    uint8_t stream;   /**< 1 for stdout, 2 for stderr. */
+    uint16_t reserved;
+} logstore_record_t;
+
+#define LOGSTORE_MAX_INDEX_ENTRIES (LOGSTORE_SEGMENT_DATA_SIZE / LOGSTORE_INDEX_INTERVAL + 1)
+#define LOGSTORE_INDEX_OFFSET ALIGN(sizeof(logstore_header_t), 4096)
+#define LOGSTORE_DATA_OFFSET (LOGSTORE_INDEX_OFFSET + ALIGN(LOGSTORE_MAX_INDEX_ENTRIES * sizeof(logstore_index_entry_t), 4096))
+#define LOGSTORE_SEGMENT_SIZE (LOGSTORE_DATA_OFFSET + LOGSTORE_SEGMENT_DATA_SIZE)
+
+/** Segment found in the directory of the store. */
+typedef struct {
+    unsigned long seq;          /**< Sequence number of the segment. */
+    unsigned long long first;   /**< Time of the first record, when sealed. */
+    unsigned long long last;    /**< Time of the last record, when sealed. */
+    bool sealed;                /**< Whether or not the segment is sealed. */
+    bool compressed;            /**< Whether or not the segment is compressed. */
+    char name[96];              /**< Name of the file. */
+} logstore_segment_t;
+
+/** State of the store. */
+typedef struct {
+    pthread_mutex_t lock;           /**< Protects concurrent appends. */
+    char dir[256];                  /**< Directory of the store. */
+    const char *progname;           /**< Name used to prefix error messages. */
+    int prefix_length;              /**< Minimum length of the prefix of error messages. */
+    unsigned long seq;              /**< Sequence number of the active segment. */
+    int fd;                         /**< File descriptor of the active segment. */
+    char *map;                      /**< Mapping of the active segment, NULL when closed. */
+} logstore_t;
+
+static logstore_t g_store = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .fd = -1,
+    .map = NULL,
+};
+
+#define HEADER(map) ((logstore_header_t *)(map))
+#define INDEX(map) ((logstore_index_entry_t *)((map) + LOGSTORE_INDEX_OFFSET))
+#define DATA(map) ((map) + LOGSTORE_DATA_OFFSET)
+
+/**
+ * Log an error of the store.
+ *
+ * @param[in] fmt Format of the message.
+ * @param[in] ... Argument(s) of the message.
+ */
+static void logstore_error(const char *fmt, ...)
+{
+    char message[512];
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(message, sizeof(message), fmt, args);
+    va_end(args);
+
+    log_message(g_store.progname, g_store.prefix_length, true, "%s", message);
+}
+
+/**
+ * Get the current time.
+ *
+ * @return Time in msec since the Epoch.
+ */
+static unsigned long long get_time_msec()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (unsigned long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Parse the name of a segment file.
+ *
+ * @param[in] name Name of the file.
+ * @param[out] segment The parsed segment.
+ *
+ * @return true if the name is the one of a segment, false otherwise.
+ */
+static bool parse_segment_name(const char *name, logstore_segment_t *segment)
+{
+    int n = 0;
+
+    if (strlen(name) >= sizeof(segment->name) || name[0] < '0' || name[0] > '9') {
+        return false;
+    }
+
+    memset(segment, 0, sizeof(*segment));
+    if (sscanf(name, "%lu-%llu-%llu.seg%n", &segment->seq, &segment->first, &segment->last, &n) == 3 && n > 0) {
+        segment->sealed = true;
+    }
+    else if (n = 0, sscanf(name, "%lu.seg%n", &segment->seq, &n) == 1 && n > 0) {
+        segment->sealed = false;
+    }
+    else {
+        return false;
+    }
+
+    if (strcmp(name + n, ".gz") == 0) {
+        segment->compressed = true;
+    }
+    else if (name[n] != '\0') {
+        return false;
+    }
+
+    strcpy(segment->name, name);
+    return true;
+}
+
+static int compare_segments(const void *a, const void *b)
+{
+    const logstore_segment_t *sa = (const logstore_segment_t *)a;
+    const logstore_segment_t *sb = (const logstore_segment_t *)b;
+
+    if (sa->seq != sb->seq) {
+        return (sa->seq < sb->seq) ? -1 : 1;
+    }
+    // Uncompressed segments first: a compressed one having the same
+    // sequence number is being written by gzip.
+    return (int)sa->compressed - (int)sb->compressed;
+}
+
+/**
+ * Get segments of a directory, sorted by sequence number.
+ *
+ * @param[in] dir Path of the directory.
+ * @param[out] count Number of segments.
+ *
+ * @return Dynamically allocated array of segments, or NULL on error.
+ */
+static logstore_segment_t *list_segments(const char *dir, size_t *count)
+{
+    DIR *d = opendir(dir);
+    if (!d) {
+        return NULL;
+    }
+
+    logstore_segment_t *segments = NULL;
+    size_t size = 0;
+    struct dirent *entry;
+
+    *count = 0;
+    while ((entry = readdir(d)) != NULL) {
+        logstore_segment_t segment;
+        if (!parse_segment_name(entry->d_name, &segment)) {
+            continue;
+        }
+        if (*count == size) {
+            size = size ? size * 2 : 16;
+            logstore_segment_t *new_segments = realloc(segments, size * sizeof(*segments));
+            if (!new_segments) {
+                free(segments);
+                closedir(d);
+                errno = ENOMEM;
+                return NULL;
+            }
+            segments = new_segments;
+        }
+        segments[(*count)++] = segment;
+    }
+    closedir(d);
+
+    if (!segments) {
+        // No segment: return an empty array.
+        segments = malloc(sizeof(*segments));
+        if (!segments) {
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+
+    qsort(segments, *count, sizeof(*segments), compare_segments);
+
+    // Keep a single entry per segment.
+    size_t j = 0;
+    for (size_t i = 0; i < *count; i++) {
+        if (j > 0 && segments[j - 1].seq == segments[i].seq) {
+            continue;
+        }
+        segments[j++] = segments[i];
+    }
+    *count = j;
+
+    return segments;
+}
+
+/**
+ * Compress a segment in the background.
+ *
+ * The gzip process is reaped by the supervisor, like any other orphan.
+ *
+ * @param[in] path Path of the segment.
+ */
+static void compress_segment(const char *path)
+{
+    char *argv[] = { "nice", "-n", "19", "gzip", "-f", "-q", (char *)path, NULL };
+    posix_spawnattr_t attr;
+    sigset_t set;
+    pid_t pid;
+
+    // The calling thread may have signals blocked.
+    sigemptyset(&set);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &set);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    int rc = posix_spawnp(&pid, argv[0], NULL, &attr, argv, environ);
+    if (rc != 0) {
+        logstore_error("could not compress log segment %s: %s.", path, strerror(rc));
+    }
+
+    posix_spawnattr_destroy(&attr);
+}
+
+/**
+ * Seal a segment: truncate it to its used size, rename it with the time range
+ * it covers and compress it.  An empty segment is removed.
+ *
+ * @param[in] seq Sequence number of the segment.
+ *
+ * @return -1 on error, with errno set, 0 otherwise.
+ */
+static int seal_segment(unsigned long seq)
+{
+    char path[512];
+    char sealed_path[512];
+    logstore_header_t header;
+
+    snprintf(path, sizeof(path), "%s/%08lu.seg", g_store.dir, seq);
+
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    else if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+             memcmp(header.magic, LOGSTORE_MAGIC, sizeof(header.magic)) != 0 ||
+             header.version != LOGSTORE_VERSION ||
+             header.data_size > LOGSTORE_SEGMENT_DATA_SIZE) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    else if (ftruncate(fd, LOGSTORE_DATA_OFFSET + header.data_size) < 0) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    close(fd);
+
+    if (header.data_size == 0) {
+        return unlink(path);
+    }
+
+    snprintf(sealed_path, sizeof(sealed_path), "%s/%08lu-%llu-%llu.seg",
+            g_store.dir, seq,
+            (unsigned long long)header.first_time,
+            (unsigned long long)header.last_time);
+    if (rename(path, sealed_path) < 0) {
+        return -1;
+    }
+
+    compress_segment(sealed_path);
+    return 0;
+}
+
+/**
+ * Remove the oldest segments, to keep at most LOGSTORE_MAX_SEGMENTS of them.
+ *
+ * @param[in] reserve Number of segments about to be created.
+ */
+static void remove_old_segments(size_t reserve)
+{
+    size_t count;
+    logstore_segment_t *segments = list_segments(g_store.dir, &count);
+    if (!segments) {
+        return;
+    }
+
+    for (size_t i = 0; i + LOGSTORE_MAX_SEGMENTS < count + reserve && i < count; i++) {
+        char path[512];
+        int len = strlen(segments[i].name) - (segments[i].compressed ? 3 : 0);
+
+        // A segment may exist in both forms while being compressed.
+        snprintf(path, sizeof(path), "%s/%.*s", g_store.dir, len, segments[i].name);
+        unlink(path);
+        snprintf(path, sizeof(path), "%s/%.*s.gz", g_store.dir, len, segments[i].name);
+        unlink(path);
+    }
+
+    free(segments);
+}
+
+/**
+ * Create and map a new active segment.
+ *
+ * @return -1 on error, with errno set, 0 otherwise.
+ */
+static int new_segment()
+{
+    char path[512];
+
+    g_store.seq++;
+    snprintf(path, sizeof(path), "%s/%08lu.seg", g_store.dir, g_store.seq);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // Allocate the whole segment now: running out of space while writing to
+    // the mapping would raise SIGBUS.
+    int rc = posix_fallocate(fd, 0, LOGSTORE_SEGMENT_SIZE);
+    if (rc != 0) {
+        close(fd);
+        unlink(path);
+        errno = rc;
+        return -1;
+    }
+
+    char *map = mmap(NULL, LOGSTORE_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        int saved_errno = errno;
+        close(fd);
+        unlink(path);
+        errno = saved_errno;
+        return -1;
+    }
+
+    memcpy(HEADER(map)->magic, LOGSTORE_MAGIC, sizeof(HEADER(map)->magic));
+    HEADER(map)->version = LOGSTORE_VERSION;
+
+    g_store.fd = fd;
+    g_store.map = map;
+    return 0;
+}
+
+/**
+ * Unmap and seal the active segment.
+ *
+ * NOTE: The mutex of the store must be locked.
+ *
+ * @return -1 on error, with errno set, 0 otherwise.
+ */
+static int close_segment()
+{
+    if (!g_store.map) {
+        return 0;
+    }
+
+    munmap(g_store.map, LOGSTORE_SEGMENT_SIZE);
+    close(g_store.fd);
+    g_store.map = NULL;
+    g_store.fd = -1;
+
+    return seal_segment(g_store.seq);
+}
+
+/**
+ * Seal the active segment and start a new one.
+ *
+ * NOTE: The mutex of the store must be locked.
+ *
+ * @return -1 on error, with errno set, 0 otherwise.
+ */
+static int rotate_segment()
+{
+    if (close_segment() < 0) {
+        logstore_error("could not seal log segment %08lu: %s.", g_store.seq, strerror(errno));
+    }
+    remove_old_segments(1);
+    return new_segment();
+}
+
+int logstore_open(const char *dir, const char *progname, int prefix_length)
+{
+    int retval = 0;
+
+    pthread_mutex_lock(&g_store.lock);
+
+    g_store.progname = progname;
+    g_store.prefix_length = prefix_length;
+    g_store.seq = 0;
+
+    if (strlen(dir) >= sizeof(g_store.dir) - 32) {
+        errno = ENAMETOOLONG;
+        retval = -1;
+    }
+    else if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        retval = -1;
+    }
+    else {
+        strcpy(g_store.dir, dir);
+
+        // Seal segments left active by a previous run and compress the ones
+        // for which it didn't complete.
+        size_t count;
+        logstore_segment_t *segments = list_segments(dir, &count);
+        if (!segments) {
+            retval = -1;
+        }
+        else {
+            for (size_t i = 0; i < count; i++) {
+                g_store.seq = segments[i].seq;
+                if (!segments[i].sealed) {
+                    if (seal_segment(segments[i].seq) < 0) {
+                        logstore_error("could not seal log segment %s/%s: %s.",
+                                dir, segments[i].name, strerror(errno));
+                    }
+                }
+                else if (!segments[i].compressed) {
+                    char path[512];
+                    snprintf(path, sizeof(path), "%s/%s", dir, segments[i].name);
+                    compress_segment(path);
+                }
+            }
+            free(segments);
+
+            remove_old_segments(1);
+            retval = new_segment();
+        }
+    }
+
+    pthread_mutex_unlock(&g_store.lock);
+    return retval;
+}
+
+void logstore_close()
+{
+    pthread_mutex_lock(&g_store.lock);
+    if (close_segment() < 0) {
+        logstore_error("could not seal log segment %08lu: %s.", g_store.seq, strerror(errno));
+    }
+    pthread_mutex_unlock(&g_store.lock);
+}
+
+/**
+ * Find a service in the table of services of the active segment, adding it
+ * if needed.
+ *
+ * @param[in] service Name of the service.
+ *
+ * @return Index of the service, or -1 if the table is full.
+ */
+static int segment_service(const char *service)
+{
+    logstore_header_t *header = HEADER(g_store.map);
+
+    for (uint32_t i = 0; i < header->num_services; i++) {
+        if (strncmp(header->services[i], service, LOGSTORE_SERVICE_NAME_SIZE - 1) == 0) {
+            return i;
+        }
+    }
+
+    if (header->num_services == LOGSTORE_MAX_SERVICES) {
+        return -1;
+    }
+    snprintf(header->services[header->num_services], LOGSTORE_SERVICE_NAME_SIZE, "%s", service);
+    return header->num_services++;
+}
+
+/**
+ * Append a record to the active segment, starting a new segment if needed.
+ *
+ * NOTE: The mutex of the store must be locked.
+ *
+ * @param[in] service Name of the service.
+ * @param[in] error Whether or not the line comes from stderr.
+ * @param[in] line The line.
+ *
+ * @return -1 on error, with errno set, 0 otherwise.
+ */
+static int append_record(const char *service, bool error, const char *line)
+{
+    size_t len = strnlen(line, LOGSTORE_MAX_LINE_LENGTH);
+    size_t size = sizeof(logstore_record_t) + ALIGN(len, 8);
+    int sid;
+
+    // Start a new segment when the active one is full.
+    if (HEADER(g_store.map)->data_size + size > LOGSTORE_SEGMENT_DATA_SIZE) {
+        if (rotate_segment() < 0) {
+            return -1;
+        }
+    }
+    if ((sid = segment_service(service)) < 0) {
+        if (rotate_segment() < 0) {
+            return -1;
+        }
+        sid = segment_service(service);
+    }
+
+    logstore_header_t *header = HEADER(g_store.map);
+
+    // Times never decrease in a segment, even if the clock goes backward.
+    unsigned long long now = get_time_msec();
+    if (now < header->last_time) {
+        now = header->last_time;
+    }
+    if (header->data_size == 0) {
+        header->first_time = now;
+    }
+
+    // Start a new index entry once the current block is full.
+    logstore_index_entry_t *index = INDEX(g_store.map);
+    uint64_t n = header->num_index_entries;
+    if (n == 0 || header->data_size >= index[n - 1].offset + LOGSTORE_INDEX_INTERVAL) {
+        index[n].time = now;
+        index[n].offset = header->data_size;
+        index[n].services = 0;
+        header->num_index_entries = ++n;
+    }
+    index[n - 1].services |= 1ULL << sid;
+
+    // Write the record.
+    logstore_record_t *rec = (logstore_record_t *)(DATA(g_store.map) + header->data_size);
+    rec->time = now;
+    rec->len = len;
+    rec->service = sid;
+    rec->stream = error ? 2 : 1;
+    rec->reserved = 0;
+    memcpy(rec + 1, line, len);
+    memset((char *)(rec + 1) + len, 0, ALIGN(len, 8) - len);
+
+    // Publish the record to concurrent readers.
+    header->last_time = now;
+    __atomic_store_n(&header->data_size, header->data_size + size, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void logstore_append(const char *service, bool error, const char *line)
+{
+    pthread_mutex_lock(&g_store.lock);
+    if (g_store.map && append_record(service ? service : "", error, line) < 0) {
+        logstore_error("could not write to log store %s, disabling it: %s.",
+                g_store.dir, strerror(errno));
+        close_segment();
+    }
+    pthread_mutex_unlock(&g_store.lock);
+}
+
+/**
+ * Read a compressed segment.
+ *
+ * @param[in] path Path of the segment.
+ * @param[out] size Size of the decompressed segment.
+ *
+ * @return Dynamically allocated decompressed segment, or NULL on error.
+ */
+static char *read_compressed_segment(const char *path, size_t *size)
+{
+    char *argv[] = { "gzip", "-d", "-c", (char *)path, NULL };
+    posix_spawn_file_actions_t actions;
+    int link[2];
+    pid_t pid;
+    char *buf = NULL;
+    size_t bufsize = 0;
+    int rc;
+
+    if (pipe2(link, O_CLOEXEC) < 0) {
+        return NULL;
+    }
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, link[1], STDOUT_FILENO);
+    rc = posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(link[1]);
+    if (rc != 0) {
+        close(link[0]);
+        errno = rc;
+        return NULL;
+    }
+
+    *size = 0;
+    while (true) {
+        if (*size == bufsize) {
+            if (bufsize >= LOGSTORE_MAX_SEGMENT_SIZE) {
+                rc = EFBIG;
+                break;
+            }
+            bufsize = bufsize ? bufsize * 2 : 65536;
+            char *new_buf = realloc(buf, bufsize);
+            if (!new_buf) {
+                rc = ENOMEM;
+                break;
+            }
+            buf = new_buf;
+        }
+
+        ssize_t n = read(link[0], buf + *size, bufsize - *size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        else if (n < 0) {
+            rc = errno;
+            break;
+        }
+        else if (n == 0) {
+            break;
+        }
+        *size += n;
+    }
+    close(link[0]);
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+    if (rc == 0 && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+        rc = EIO;
+    }
+
+    if (rc != 0) {
+        free(buf);
+        errno = rc;
+        return NULL;
+    }
+    return buf;
+}
+
+/**
+ * Format a time as an ISO 8601 UTC timestamp, with msec.
+ *
+ * @param[out] buf Where to store the timestamp.
+ * @param[in] size Size of the buffer.
+ * @param[in] time Time, in msec since the Epoch.
+ */
+static void format_time(char *buf, size_t size, unsigned long long time)
+{
+    time_t sec = time / 1000;
+    struct tm tm;
+
+    gmtime_r(&sec, &tm);
+    size_t len = strftime(buf, size, "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(buf + len, size - len, ".%03lluZ", time % 1000);
+}
+
+/**
+ * Print lines of a segment.
+ *
+ * @param[in] map Content of the segment.
+ * @param[in] size Size of the segment.
+ * @param[in] service Name of the service, or NULL for all services.
+ * @param[in] since Print lines logged at or after this time.
+ * @param[in] until Print lines logged at or before this time.
+ * @param[in] out Where to print lines.
+ */
+static void query_segment(const char *map, size_t size, const char *service,
+        unsigned long long since, unsigned long long until, FILE *out)
+{
+    const logstore_header_t *header = HEADER(map);
+    const logstore_index_entry_t *index = INDEX(map);
+    const char *data = DATA(map);
+
+    if (size < LOGSTORE_DATA_OFFSET ||
+        memcmp(header->magic, LOGSTORE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != LOGSTORE_VERSION) {
+        return;
+    }
+
+    uint64_t data_size = __atomic_load_n(&header->data_size, __ATOMIC_ACQUIRE);
+    data_size = MIN(data_size, size - LOGSTORE_DATA_OFFSET);
+    uint64_t n = MIN(header->num_index_entries, LOGSTORE_MAX_INDEX_ENTRIES);
+    uint32_t num_services = MIN(header->num_services, LOGSTORE_MAX_SERVICES);
+
+    // Get the service's bit, if a service is requested.
+    uint64_t mask = ~0ULL;
+    if (service) {
+        mask = 0;
+        for (uint32_t i = 0; i < num_services; i++) {
+            if (strncmp(header->services[i], service, LOGSTORE_SERVICE_NAME_SIZE - 1) == 0) {
+                mask = 1ULL << i;
+                break;
+            }
+        }
+        if (!mask) {
+            return;
+        }
+    }
+
+    // Find the first entry having a time at or after the requested one.
+    // Lines logged at this time can also be in the preceding block.
+    uint64_t lo = 0, hi = n;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (index[mid].time < since) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    for (uint64_t e = (lo > 0) ? lo - 1 : 0; e < n; e++) {
+        uint64_t ofs = index[e].offset;
+        uint64_t end = (e + 1 < n) ? MIN(index[e + 1].offset, data_size) : data_size;
+
+        if (index[e].time > until) {
+            break;
+        }
+        else if (!(index[e].services & mask)) {
+            // No line of the service in this block.
+            continue;
+        }
+
+        while (ofs + sizeof(logstore_record_t) <= end) {
+            const logstore_record_t *rec = (const logstore_record_t *)(data + ofs);
+            uint64_t rec_size = sizeof(logstore_record_t) + ALIGN((uint64_t)rec->len, 8);
+
+            if (ofs + rec_size > data_size || rec->service >= num_services || rec->time > until) {
+                // Corrupted record or end of the time range.
+                return;
+            }
+            else if (rec->time >= since && (mask & (1ULL << rec->service))) {
+                char timestamp[32];
+                format_time(timestamp, sizeof(timestamp), rec->time);
+                if (service) {
+                    fprintf(out, "%s %.*s\n", timestamp, (int)rec->len, (const char *)(rec + 1));
+                }
+                else {
+                    fprintf(out, "%s [%.*s] %.*s\n", timestamp,
+                            (int)strnlen(header->services[rec->service], LOGSTORE_SERVICE_NAME_SIZE),
+                            header->services[rec->service],
+                            (int)rec->len, (const char *)(rec + 1));
+                }
+            }
+            ofs += rec_size;
+        }
+    }
+}
+
+int logstore_query(const char *dir, const char *service, unsigned long long since, unsigned long long until, FILE *out)
+{
+    size_t count;
+    logstore_segment_t *segments = list_segments(dir, &count);
+    if (!segments) {
+        return -1;
+    }
+
+    // Find the first segment possibly having lines at or after the requested
+    // time.  Sealed segments have their time range in their name.
+    size_t lo = 0, hi = count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (segments[mid].sealed && segments[mid].last < since) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    for (size_t i = lo; i < count; i++) {
+        char path[512];
+        char *map = NULL;
+        size_t size = 0;
+
+        if (segments[i].sealed && segments[i].first > until) {
+            break;
+        }
+
+        snprintf(path, sizeof(path), "%s/%s", dir, segments[i].name);
+        if (segments[i].compressed) {
+            map = read_compressed_segment(path, &size);
+            if (map) {
+                query_segment(map, size, service, since, until, out);
+                free(map);
+            }
+        }
+        else {
+            // The segment may get compressed or removed meanwhile.
+            int fd = open(path, O_RDONLY | O_CLOEXEC);
+            struct stat st;
+            if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+                size = st.st_size;
+                map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+                if (map != MAP_FAILED) {
+                    query_segment(map, size, service, since, until, out);
+                    munmap(map, size);
+                }
+            }
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+
+    free(segments);
+    return 0;
+}
@@ -0,0 +1,83 @@
+#ifndef __CINIT_LOGSTORE_H__
+#define __CINIT_LOGSTORE_H__
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/**
+ * Persistent store of service output.
+ *
+ * Lines are appended to segment files of a directory.  A segment is a file of
+ * fixed maximum size, mapped in memory, with the following layout:
+ *
+ *   - A header, with the time range covered by the segment and the table of
+ *     services having lines in it.
+ *   - A sparse index, with one entry per block of data.  An entry has the time
+ *     and the offset of the first record of the block, along with the bitmap
+ *     of services having lines in the block.
+ *   - The records, each one being a line with its time, service and stream.
+ *
+ * Times of records never decrease, so the index can be binary searched.
+ *
+ * The active segment is named NNNNNNNN.seg.  Once full, it is sealed: it is
+ * truncated to its used size, renamed NNNNNNNN-FIRST-LAST.seg (the time range
+ * it covers, in msec since the Epoch) and compressed in the background by
+ * gzip.  Only the most recent segments are kept.
+ */
+
+/**
+ * Default directory of the log store.
+ */
+#define LOGSTORE_DEFAULT_DIR "/config/log"
+
+/**
+ * Open the log store and start a new segment.
+ *
+ * Segments left active by a previous run are sealed and segments not yet
+ * compressed are compressed.
+ *
+ * @param[in] dir Directory of the log store.  Created if needed.
+ * @param[in] progname Name used to prefix error messages.
+ * @param[in] prefix_length Minimum length of the prefix of error messages.
+ *
+ * @return -1 on error, with errno set, 0 otherwise.
+ */
+int logstore_open(const char *dir, const char *progname, int prefix_length);
+
+/**
+ * Seal the active segment and close the log store.
+ */
+void logstore_close();
+
+/**
+ * Append a line to the log store.
+ *
+ * This function is thread-safe.  It does nothing if the store is not opened.
+ * On error, the error is logged and the store is closed.
+ *
+ * @param[in] service Name of the service that produced the line.
+ * @param[in] error Whether or not the line comes from stderr.
+ * @param[in] line The line, without the newline character.
+ */
+void logstore_append(const char *service, bool error, const char *line);
+
+/**
+ * Print lines of the log store.
+ *
+ * Segments not covering the time range are skipped based on their name and
+ * the first record to print is located by a binary search of the index.
+ * Blocks without line of the requested service are skipped.
+ *
+ * @param[in] dir Directory of the log store.
+ * @param[in] service Name of the service, or NULL for all services.
+ * @param[in] since Print lines logged at or after this time (msec since the
+ *                  Epoch).
+ * @param[in] until Print lines logged at or before this time (msec since the
+ *                  Epoch).
+ * @param[in] out Where to print lines.
+ *
+ * @return -1 on error, with errno set, 0 otherwise.
+ */
+int logstore_query(const char *dir, const char *service, unsigned long long since, unsigned long long until, FILE *out);
+
+#endif // __CINIT_LOGSTORE_H__
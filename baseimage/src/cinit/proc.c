@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <dirent.h>
+
+#include "proc.h"
+
+/**
+ * Read a small file of /proc into the provided buffer.
+ *
+ * @param[in] pid PID of the process.
+ * @param[in] name Name of the file.
+ * @param[out] buf Buffer where to store the NULL terminated content.
+ * @param[in] bufsize Size of the buffer.
+ *
+ * @return Number of bytes read or -1 on error.
+ */
+static ssize_t read_proc_file(pid_t pid, const char *name, char *buf, size_t bufsize)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/%s", pid, name);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    ssize_t len = read(fd, buf, bufsize - 1);
+    close(fd);
+    if (len < 0) {
+        return -1;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+/**
+ * Get the value of a "Key: value" line.
+ *
+ * @param[in] buf Content of the file.
+ * @param[in] key Key to search, including the colon.
+ *
+ * @return The value or 0 if key not found.
+ */
+static unsigned long long get_keyed_value(const char *buf, const char *key)
+{
+    size_t key_len = strlen(key);
+    const char *p = buf;
+
+    while (p) {
+        if (strncmp(p, key, key_len) == 0) {
+            return strtoull(p + key_len, NULL, 10);
+        }
+        p = strchr(p, '\n');
+        if (p) {
+            p++;
+        }
+    }
+    return 0;
+}
+
+int proc_sample_group(pid_t pgid, proc_stats_t *stats)
+{
+    static long ticks_per_sec = 0;
+    static long page_size = 0;
+
+    if (ticks_per_sec == 0) {
+        ticks_per_sec = sysconf(_SC_CLK_TCK);
+        page_size = sysconf(_SC_PAGESIZE);
+    }
+
+    memset(stats, 0, sizeof(*stats));
+
+    DIR *dirstream = opendir("/proc");
+    if (!dirstream) {
+        return -1;
+    }
+
+    struct dirent *dir;
+    while ((dir = readdir(dirstream)) != NULL) {
+        char buf[2048];
+        unsigned long long utime, stime;
+        long long cutime, cstime;
+        int pgrp;
+
+        if (!isdigit(dir->d_name[0])) {
+            continue;
+        }
+        pid_t pid = atoi(dir->d_name);
+
+        // Get the process group and CPU times.  The command name is enclosed
+        // in parentheses and may contain spaces: fields are parsed from the
+        // last closing parenthesis.
+        if (read_proc_file(pid, "stat", buf, sizeof(buf)) < 0) {
+            continue;
+        }
+        char *p = strrchr(buf, ')');
+        if (!p || sscanf(p + 2,
+                    "%*c %*d %d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %lld %lld",
+                    &pgrp, &utime, &stime, &cutime, &cstime) != 5) {
+            continue;
+        }
+        if (pgrp != pgid) {
+            continue;
+        }
+
+        stats->num_processes++;
+        stats->cpu_time += (utime + stime + cutime + cstime) * 1000 / ticks_per_sec;
+
+        // Get memory usage.
+        if (read_proc_file(pid, "statm", buf, sizeof(buf)) > 0) {
+            unsigned long long resident;
+            if (sscanf(buf, "%*u %llu", &resident) == 1) {
+                stats->rss += resident * page_size;
+            }
+        }
+        if (read_proc_file(pid, "smaps_rollup", buf, sizeof(buf)) > 0) {
+            stats->pss += get_keyed_value(buf, "Pss:") * 1024;
+        }
+
+        // Get I/O usage.
+        if (read_proc_file(pid, "io", buf, sizeof(buf)) > 0) {
+            stats->read_bytes += get_keyed_value(buf, "read_bytes:");
+            stats->write_bytes += get_keyed_value(buf, "write_bytes:");
+        }
+    }
+
+    closedir(dirstream);
+    return 0;
+}
+
+void proc_add_rusage(const struct rusage *usage, proc_stats_t *stats)
+{
+    stats->cpu_time += (usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) * 1000ULL +
+                       (usage->ru_utime.tv_usec + usage->ru_stime.tv_usec) / 1000;
+    stats->read_bytes += usage->ru_inblock * 512ULL;
+    stats->write_bytes += usage->ru_oublock * 512ULL;
+}
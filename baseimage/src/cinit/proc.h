@@ -0,0 +1,42 @@
+#ifndef __CINIT_PROC_H__
+#define __CINIT_PROC_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+/**
+ * Resource usage of a set of processes.
+ */
+typedef struct {
+    unsigned long long cpu_time;    /**< User and system CPU time, in msec. */
+    unsigned long long rss;         /**< Resident set size, in bytes. */
+    unsigned long long pss;         /**< Proportional set size, in bytes. */
+    unsigned long long read_bytes;  /**< Bytes read from storage. */
+    unsigned long long write_bytes; /**< Bytes written to storage. */
+    unsigned int num_processes;     /**< Number of processes. */
+} proc_stats_t;
+
+/**
+ * Sample the resource usage of all processes of a process group.
+ *
+ * Statistics are gathered from /proc/<pid>/stat, statm, smaps_rollup and io.
+ * CPU time of terminated children already waited for by a member of the group
+ * is included.
+ *
+ * @param[in] pgid ID of the process group.
+ * @param[out] stats Where to store the statistics.
+ *
+ * @return 0 on success, -1 if /proc could not be read.
+ */
+int proc_sample_group(pid_t pgid, proc_stats_t *stats);
+
+/**
+ * Accumulate the resource usage of a terminated process.
+ *
+ * @param[in] usage Resource usage, as returned by wait4().
+ * @param[in,out] stats Statistics to update.
+ */
+void proc_add_rusage(const struct rusage *usage, proc_stats_t *stats);
+
+#endif // __CINIT_PROC_H__
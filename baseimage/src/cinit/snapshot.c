@@ -0,0 +1,629 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "snapshot.h"
+#include "CException.h"
+
+#define SNAPSHOT_MAGIC "CINITSNP"
+#define SNAPSHOT_VERSION 1
+
+/** Do not store static items bigger than 1MB. */
+#define SNAPSHOT_MAX_ITEM_SIZE 1048576
+
+/* Item flags. */
+#define SNAPSHOT_ITEM_REGULAR    (1 << 0)
+#define SNAPSHOT_ITEM_EXECUTABLE (1 << 1)
+#define SNAPSHOT_ITEM_DATA       (1 << 2)
+
+/**
+ * Header of a snapshot file.
+ *
+ * The header is followed by the table of directories, the table of items and
+ * the string area.  All offsets are relative to the beginning of the string
+ * area.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_dirs;
+    uint32_t num_items;
+    uint32_t strings_size;
+    char root[PATH_MAX];
+} snapshot_header_t;
+
+/**
+ * Directory of a snapshot.  The first directory is the root directory itself.
+ */
+typedef struct {
+    uint32_t name_ofs;
+    uint32_t first_item;
+    uint32_t num_items;
+    uint32_t reserved;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} snapshot_dir_t;
+
+/**
+ * Item of a snapshot directory.
+ */
+typedef struct {
+    uint32_t name_ofs;
+    uint32_t flags;
+    uint32_t data_ofs;
+    uint32_t data_len;
+} snapshot_entry_t;
+
+/**
+ * Growable memory area, used when compiling a snapshot.
+ */
+typedef struct {
+    char *data;
+    size_t size;
+    size_t used;
+} area_t;
+
+/* The mapped snapshot. */
+static struct {
+    void *addr;
+    size_t size;
+    const snapshot_header_t *header;
+    const snapshot_dir_t *dirs;
+    const snapshot_entry_t *items;
+    const char *strings;
+    int current_dir;
+} g_snapshot = {
+    .addr = NULL,
+    .current_dir = -1,
+};
+
+/**
+ * Reserve space at the end of an area.
+ *
+ * @param[in,out] area The area.
+ * @param[in] len Number of bytes to reserve.
+ *
+ * @return Offset of the reserved space.
+ */
+static size_t area_reserve(area_t *area, size_t len)
+{
+    if (area->used + len > area->size) {
+        size_t size = area->size ? area->size : 4096;
+        while (area->used + len > size) {
+            size *= 2;
+        }
+        char *data = realloc(area->data, size);
+        if (!data) {
+            ThrowMessage("out of memory");
+        }
+        area->data = data;
+        area->size = size;
+    }
+
+    size_t ofs = area->used;
+    area->used += len;
+    return ofs;
+}
+
+/**
+ * Append data to an area.
+ *
+ * @param[in,out] area The area.
+ * @param[in] data Data to append.
+ * @param[in] len Length of the data.
+ *
+ * @return Offset of the appended data.
+ */
+static size_t area_append(area_t *area, const void *data, size_t len)
+{
+    size_t ofs = area_reserve(area, len);
+    memcpy(area->data + ofs, data, len);
+    return ofs;
+}
+
+/**
+ * Append a string, including its terminating NULL character, to an area.
+ *
+ * @param[in,out] area The area.
+ * @param[in] str String to append.
+ *
+ * @return Offset of the appended string.
+ */
+static size_t area_append_str(area_t *area, const char *str)
+{
+    return area_append(area, str, strlen(str) + 1);
+}
+
+/**
+ * Append the content of a file to an area, followed by a NULL character.
+ *
+ * @param[in,out] area The area.
+ * @param[in] dirfd File descriptor of the directory containing the file.
+ * @param[in] name Name of the file.
+ * @param[out] len Length of the content.
+ *
+ * @return Offset of the appended content.
+ */
+static size_t area_append_file(area_t *area, int dirfd, const char *name, size_t *len)
+{
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        ThrowMessageWithErrno("could not open '%s': ", name);
+    }
+
+    size_t ofs = area->used;
+    *len = 0;
+    while (true) {
+        char buf[4096];
+        ssize_t rc = read(fd, buf, sizeof(buf));
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        }
+        else if (rc < 0) {
+            close(fd);
+            ThrowMessageWithErrno("could not read '%s': ", name);
+        }
+        else if (rc == 0) {
+            break;
+        }
+        else if (*len + rc > SNAPSHOT_MAX_ITEM_SIZE) {
+            close(fd);
+            ThrowMessage("could not read '%s': file too big", name);
+        }
+        area_append(area, buf, rc);
+        *len += rc;
+    }
+    close(fd);
+
+    area_append(area, "", 1);
+    return ofs;
+}
+
+/**
+ * Add a service directory to a snapshot being compiled.
+ *
+ * @param[in] root Path of the services root directory.
+ * @param[in] name Name of the service directory.
+ * @param[in,out] dirs Table of directories.
+ * @param[in,out] items Table of items.
+ * @param[in,out] strings String area.
+ */
+static void compile_dir(const char *root, const char *name, area_t *dirs, area_t *items, area_t *strings)
+{
+    CEXCEPTION_T e;
+
+    char path[PATH_MAX];
+    struct stat st;
+    snapshot_dir_t dir = { 0 };
+
+    if (snprintf(path, sizeof(path), "%s/%s", root, name) >= sizeof(path)) {
+        ThrowMessage("path too long: %s/%s", root, name);
+    }
+
+    DIR *dirstream = opendir(path);
+    if (!dirstream) {
+        ThrowMessageWithErrno("could not open directory '%s': ", path);
+    }
+
+    Try {
+        if (fstat(dirfd(dirstream), &st) < 0) {
+            ThrowMessageWithErrno("could not get info of '%s': ", path);
+        }
+
+        dir.name_ofs = area_append_str(strings, name);
+        dir.first_item = items->used / sizeof(snapshot_entry_t);
+        dir.mtime_sec = st.st_mtim.tv_sec;
+        dir.mtime_nsec = st.st_mtim.tv_nsec;
+
+        struct dirent *de;
+        while ((de = readdir(dirstream)) != NULL) {
+            snapshot_entry_t item = { 0 };
+
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+                continue;
+            }
+
+            // Only files are configuration items.  Symbolic links are
+            // followed.
+            if (fstatat(dirfd(dirstream), de->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode)) {
+                continue;
+            }
+
+            item.name_ofs = area_append_str(strings, de->d_name);
+            if (de->d_type == DT_REG) {
+                item.flags |= SNAPSHOT_ITEM_REGULAR;
+            }
+
+            if (st.st_mode & S_IXUSR) {
+                // Executable item: only its real path is kept.
+                char item_path[PATH_MAX];
+                char real[PATH_MAX];
+
+                if (snprintf(item_path, sizeof(item_path), "%s/%s", path, de->d_name) >= sizeof(item_path)) {
+                    ThrowMessage("path too long: %s/%s", path, de->d_name);
+                }
+                if (!realpath(item_path, real)) {
+                    ThrowMessageWithErrno("could not get realpath of '%s': ", item_path);
+                }
+                item.flags |= SNAPSHOT_ITEM_EXECUTABLE;
+                item.data_ofs = area_append_str(strings, real);
+                item.data_len = strlen(real);
+            }
+            else {
+                // Static item: keep its content.
+                size_t len;
+                item.flags |= SNAPSHOT_ITEM_DATA;
+                item.data_ofs = area_append_file(strings, dirfd(dirstream), de->d_name, &len);
+                item.data_len = len;
+            }
+
+            area_append(items, &item, sizeof(item));
+            dir.num_items++;
+        }
+
+        area_append(dirs, &dir, sizeof(dir));
+    }
+    Catch (e) {
+        closedir(dirstream);
+        Throw(e);
+    }
+
+    closedir(dirstream);
+}
+
+int snapshot_compile(const char *root, const char *path)
+{
+    CEXCEPTION_T e;
+
+    area_t dirs = { 0 };
+    area_t items = { 0 };
+    area_t strings = { 0 };
+    snapshot_header_t header = { 0 };
+    char tmp_path[PATH_MAX];
+    int fd = -1;
+
+    Try {
+        struct stat st;
+
+        if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= sizeof(tmp_path)) {
+            ThrowMessage("snapshot path too long");
+        }
+
+        // Add the root directory.
+        DIR *dirstream = opendir(root);
+        if (!dirstream) {
+            ThrowMessageWithErrno("could not open directory '%s': ", root);
+        }
+        if (fstat(dirfd(dirstream), &st) < 0) {
+            closedir(dirstream);
+            ThrowMessageWithErrno("could not get info of '%s': ", root);
+        }
+        {
+            snapshot_dir_t dir = {
+                .name_ofs = area_append_str(&strings, ""),
+                .mtime_sec = st.st_mtim.tv_sec,
+                .mtime_nsec = st.st_mtim.tv_nsec,
+            };
+            area_append(&dirs, &dir, sizeof(dir));
+        }
+
+        // Add service directories.
+        Try {
+            struct dirent *de;
+            while ((de = readdir(dirstream)) != NULL) {
+                if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+                    continue;
+                }
+                if (fstatat(dirfd(dirstream), de->d_name, &st, 0) < 0 || !S_ISDIR(st.st_mode)) {
+                    continue;
+                }
+                compile_dir(root, de->d_name, &dirs, &items, &strings);
+            }
+        }
+        Catch (e) {
+            closedir(dirstream);
+            Throw(e);
+        }
+        closedir(dirstream);
+
+        // Fill the header.
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.version = SNAPSHOT_VERSION;
+        header.num_dirs = dirs.used / sizeof(snapshot_dir_t);
+        header.num_items = items.used / sizeof(snapshot_entry_t);
+        header.strings_size = strings.used;
+        if (snprintf(header.root, sizeof(header.root), "%s", root) >= sizeof(header.root)) {
+            ThrowMessage("root directory path too long");
+        }
+
+        // Write the snapshot.  It is first written to a temporary file, which
+        // is then atomically renamed.
+        fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            ThrowMessageWithErrno("could not create '%s': ", tmp_path);
+        }
+
+        const struct {
+            const void *data;
+            size_t len;
+        } parts[] = {
+            { &header, sizeof(header) },
+            { dirs.data, dirs.used },
+            { items.data, items.used },
+            { strings.data, strings.used },
+        };
+        for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+            if (parts[i].len > 0 && write(fd, parts[i].data, parts[i].len) != parts[i].len) {
+                ThrowMessageWithErrno("could not write '%s': ", tmp_path);
+            }
+        }
+
+        if (fsync(fd) < 0 || close(fd) < 0) {
+            fd = -1;
+            ThrowMessageWithErrno("could not write '%s': ", tmp_path);
+        }
+        fd = -1;
+
+        if (rename(tmp_path, path) < 0) {
+            ThrowMessageWithErrno("could not rename '%s': ", tmp_path);
+        }
+    }
+    Catch (e) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp_path);
+        }
+        free(dirs.data);
+        free(items.data);
+        free(strings.data);
+        fprintf(stderr, "%s\n", e.mMessage);
+        errno = EINVAL;
+        return -1;
+    }
+
+    free(dirs.data);
+    free(items.data);
+    free(strings.data);
+    return 0;
+}
+
+/**
+ * Validate the structure of the mapped snapshot.
+ *
+ * @return 0 if the snapshot is valid, -1 otherwise.
+ */
+static int validate_structure()
+{
+    const snapshot_header_t *header = g_snapshot.header;
+
+    if (g_snapshot.size < sizeof(*header) ||
+        memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != SNAPSHOT_VERSION ||
+        header->num_dirs == 0 ||
+        header->root[sizeof(header->root) - 1] != '\0') {
+        return -1;
+    }
+
+    size_t expected_size = sizeof(*header) +
+                           (size_t)header->num_dirs * sizeof(snapshot_dir_t) +
+                           (size_t)header->num_items * sizeof(snapshot_entry_t) +
+                           header->strings_size;
+    if (g_snapshot.size != expected_size) {
+        return -1;
+    }
+
+    g_snapshot.dirs = (const snapshot_dir_t *)(header + 1);
+    g_snapshot.items = (const snapshot_entry_t *)(g_snapshot.dirs + header->num_dirs);
+    g_snapshot.strings = (const char *)(g_snapshot.items + header->num_items);
+
+    // All strings must be NULL terminated inside the string area.
+    if (header->strings_size == 0 || g_snapshot.strings[header->strings_size - 1] != '\0') {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < header->num_dirs; i++) {
+        const snapshot_dir_t *dir = &g_snapshot.dirs[i];
+        if (dir->name_ofs >= header->strings_size ||
+            dir->first_item > header->num_items ||
+            dir->num_items > header->num_items - dir->first_item) {
+            return -1;
+        }
+    }
+
+    for (uint32_t i = 0; i < header->num_items; i++) {
+        const snapshot_entry_t *item = &g_snapshot.items[i];
+        if (item->name_ofs >= header->strings_size ||
+            item->data_ofs >= header->strings_size ||
+            item->data_len >= header->strings_size - item->data_ofs) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Check if the mapped snapshot is up to date.
+ *
+ * @param[in] root Path of the services root directory.
+ *
+ * @return 0 if the snapshot is up to date, -1 otherwise.
+ */
+static int validate_mtimes(const char *root)
+{
+    for (uint32_t i = 0; i < g_snapshot.header->num_dirs; i++) {
+        const snapshot_dir_t *dir = &g_snapshot.dirs[i];
+        char path[PATH_MAX];
+        struct stat st;
+
+        snprintf(path, sizeof(path), "%s/%s", root, g_snapshot.strings + dir->name_ofs);
+        if (stat(path, &st) < 0 ||
+            st.st_mtim.tv_sec != dir->mtime_sec ||
+            st.st_mtim.tv_nsec != dir->mtime_nsec) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int snapshot_load(const char *path, const char *root)
+{
+    struct stat st;
+
+    snapshot_unload();
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    else if (st.st_size < sizeof(snapshot_header_t)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return -1;
+    }
+
+    g_snapshot.addr = addr;
+    g_snapshot.size = st.st_size;
+    g_snapshot.header = addr;
+
+    if (validate_structure() < 0) {
+        snapshot_unload();
+        errno = EINVAL;
+        return -1;
+    }
+    else if (strcmp(g_snapshot.header->root, root) != 0 || validate_mtimes(root) < 0) {
+        snapshot_unload();
+        errno = ESTALE;
+        return -1;
+    }
+
+    return 0;
+}
+
+void snapshot_unload()
+{
+    if (g_snapshot.addr) {
+        munmap(g_snapshot.addr, g_snapshot.size);
+    }
+    g_snapshot.addr = NULL;
+    g_snapshot.size = 0;
+    g_snapshot.header = NULL;
+    g_snapshot.dirs = NULL;
+    g_snapshot.items = NULL;
+    g_snapshot.strings = NULL;
+    g_snapshot.current_dir = -1;
+}
+
+void snapshot_chdir(const char *dir)
+{
+    g_snapshot.current_dir = -1;
+
+    if (!g_snapshot.addr || !dir) {
+        return;
+    }
+
+    // The first directory is the root one.
+    for (uint32_t i = 1; i < g_snapshot.header->num_dirs; i++) {
+        if (strcmp(g_snapshot.strings + g_snapshot.dirs[i].name_ofs, dir) == 0) {
+            g_snapshot.current_dir = i;
+            return;
+        }
+    }
+}
+
+/**
+ * Fill an item from its snapshot entry.
+ *
+ * @param[in] entry The entry.
+ * @param[out] item The item to fill.
+ */
+static void fill_item(const snapshot_entry_t *entry, snapshot_item_t *item)
+{
+    item->name = g_snapshot.strings + entry->name_ofs;
+    item->regular = entry->flags & SNAPSHOT_ITEM_REGULAR;
+    item->executable = entry->flags & SNAPSHOT_ITEM_EXECUTABLE;
+    item->realpath = item->executable ? g_snapshot.strings + entry->data_ofs : NULL;
+    item->data = (entry->flags & SNAPSHOT_ITEM_DATA) ? g_snapshot.strings + entry->data_ofs : NULL;
+    item->data_len = (entry->flags & SNAPSHOT_ITEM_DATA) ? entry->data_len : 0;
+}
+
+int snapshot_lookup(const char *name, snapshot_item_t *item)
+{
+    if (!g_snapshot.addr || g_snapshot.current_dir < 0) {
+        return -1;
+    }
+
+    // Only items of the selected directory are known.
+    if (strchr(name, '/')) {
+        return -1;
+    }
+
+    const snapshot_dir_t *dir = &g_snapshot.dirs[g_snapshot.current_dir];
+    for (uint32_t i = 0; i < dir->num_items; i++) {
+        const snapshot_entry_t *entry = &g_snapshot.items[dir->first_item + i];
+        if (strcmp(g_snapshot.strings + entry->name_ofs, name) == 0) {
+            fill_item(entry, item);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int snapshot_get_item(unsigned int index, snapshot_item_t *item)
+{
+    if (!g_snapshot.addr || g_snapshot.current_dir < 0) {
+        return -1;
+    }
+
+    const snapshot_dir_t *dir = &g_snapshot.dirs[g_snapshot.current_dir];
+    if (index >= dir->num_items) {
+        return 0;
+    }
+
+    fill_item(&g_snapshot.items[dir->first_item + index], item);
+    return 1;
+}
+
+void snapshot_read_item(const snapshot_item_t *item, char **buf, size_t bufsize)
+{
+    bool alloc_buf = (*buf == NULL);
+
+    // If a buffer is provided, its size should not be 0.
+    assert(*buf == NULL || bufsize > 0);
+
+    if (!item->data) {
+        ThrowMessage("no content");
+    }
+
+    if (alloc_buf) {
+        *buf = malloc(item->data_len + 1);
+        if (!*buf) {
+            ThrowMessage("memory allocation failed");
+        }
+    }
+    else if (item->data_len > bufsize - 1) {
+        ThrowMessage("buffer too small");
+    }
+
+    memcpy(*buf, item->data, item->data_len);
+    (*buf)[item->data_len] = '\0';
+}
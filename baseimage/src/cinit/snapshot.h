@@ -0,0 +1,104 @@
+#ifndef __CINIT_SNAPSHOT_H__
+#define __CINIT_SNAPSHOT_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Services configuration snapshot.
+ *
+ * A snapshot is a single binary file capturing the content of the services
+ * root directory: every service directory, the list of its configuration
+ * items (in directory order) and the content of static (non-executable) items.
+ * Executable items are recorded with their real path, but they are still run
+ * at load time, since their output may depend on the environment.
+ *
+ * A snapshot is considered stale as soon as the modification time of the root
+ * directory or of a service directory changes.  Note that modifying the
+ * content of an existing file in place doesn't update the modification time
+ * of its directory: the snapshot needs to be compiled again in this case.
+ */
+
+/**
+ * Configuration item of a snapshot.
+ */
+typedef struct {
+    const char *name;     /**< Name of the item. */
+    bool regular;         /**< Whether or not the item is a regular file (not a symbolic link). */
+    bool executable;      /**< Whether or not the item is executable. */
+    const char *realpath; /**< Canonical, absolute path of an executable item. */
+    const char *data;     /**< NULL terminated content of a static item. */
+    size_t data_len;      /**< Length of the content. */
+} snapshot_item_t;
+
+/**
+ * Compile a snapshot of a services root directory.
+ *
+ * @param[in] root Path of the services root directory.
+ * @param[in] path Path of the snapshot file to create.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int snapshot_compile(const char *root, const char *path);
+
+/**
+ * Map a snapshot file in memory and validate it.
+ *
+ * @param[in] path Path of the snapshot file.
+ * @param[in] root Path of the services root directory.
+ *
+ * @return 0 on success, -1 on error.  errno is set to ESTALE when the
+ *         snapshot is out of date.
+ */
+int snapshot_load(const char *path, const char *root);
+
+/**
+ * Unmap the snapshot from memory.
+ */
+void snapshot_unload();
+
+/**
+ * Select the service directory used by subsequent lookups.
+ *
+ * @param[in] dir Name of the service directory, NULL to select none.
+ */
+void snapshot_chdir(const char *dir);
+
+/**
+ * Look up a configuration item in the selected service directory.
+ *
+ * @param[in] name Name of the item.
+ * @param[out] item Where to store the item.
+ *
+ * @return 1 if the item was found, 0 if it doesn't exist or -1 if the
+ *         snapshot can't answer (no snapshot or no directory selected).
+ */
+int snapshot_lookup(const char *name, snapshot_item_t *item);
+
+/**
+ * Get a configuration item of the selected service directory by index.
+ *
+ * Items are returned in the same order as they were read from the directory.
+ *
+ * @param[in] index Index of the item.
+ * @param[out] item Where to store the item.
+ *
+ * @return 1 if the item was found, 0 if index is out of range or -1 if the
+ *         snapshot can't answer (no snapshot or no directory selected).
+ */
+int snapshot_get_item(unsigned int index, snapshot_item_t *item);
+
+/**
+ * Copy the content of a static item.
+ *
+ * This follows the semantic of read_file().
+ *
+ * @param[in] item The item.
+ * param[in,out] buf Pointer to the buffer where to store the item's content.
+ *                   When pointing to a NULL buffer, memory is dynamically
+ *                   allocated.
+ * param[in] bufsize Size of the provided buffer.
+ */
+void snapshot_read_item(const snapshot_item_t *item, char **buf, size_t bufsize);
+
+#endif // __CINIT_SNAPSHOT_H__
@@ -0,0 +1,669 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "stages.h"
+#include "utils.h"
+#include "log.h"
+
+/**
+ * File where loaded environment variables are saved, so they can be sourced
+ * by login shells.
+ */
+#define CONT_ENV_SAVE_FILE "/var/tmp/.cont-env-internal"
+
+/**
+ * Prefix of Docker secrets defining environment variables.
+ */
+#define CONT_SECRETS_PREFIX "CONT_ENV_"
+
+/**
+ * Exit code of a cont-env program indicating that the variable should not be
+ * set.
+ */
+#define CONT_ENV_SKIP_EXIT_CODE 100
+
+/**
+ * Header declaring the dependencies of an initialization script.
+ */
+#define CONT_INIT_DEPENDS_HEADER "# cinit-depends:"
+
+/**
+ * Number of lines, from the beginning of an initialization script, where the
+ * dependencies header is searched.
+ */
+#define CONT_INIT_HEADER_MAX_LINES 32
+
+/**
+ * Maximum number of initialization scripts.
+ */
+#define CONT_INIT_MAX_SCRIPTS 128
+
+/**
+ * Maximum number of initialization scripts running at the same time.
+ */
+#define CONT_INIT_MAX_PARALLEL_SCRIPTS 8
+
+#define log(stage, fmt, arg...) log_message(stage, g_prefix_length, false, fmt, ##arg)
+
+/** State of an initialization script. */
+typedef enum {
+    SCRIPT_PENDING = 0,
+    SCRIPT_RUNNING,
+    SCRIPT_DONE,
+} script_state_t;
+
+struct init_ctx;
+
+/** Definition of an initialization script. */
+typedef struct {
+    char name[NAME_MAX + 1];
+    char path[PATH_MAX];
+    bool executable;
+    bool has_header;
+    bool deps[CONT_INIT_MAX_SCRIPTS];
+    script_state_t state;
+    int exit_code;
+    bool thread_started;
+    pthread_t thread;
+    struct init_ctx *ctx;
+} script_t;
+
+/** Context of the cont-init stage. */
+typedef struct init_ctx {
+    script_t *scripts;
+    size_t num_scripts;
+    unsigned int num_running;
+    int exit_code;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} init_ctx_t;
+
+/** Context used to get the value of a cont-env program. */
+typedef struct {
+    const char *stage;
+    const char *name;
+    char *value;
+} env_program_ctx_t;
+
+/* Length of log prefixes. */
+static int g_prefix_length = 0;
+
+/**
+ * Log a line of output produced by a script.
+ *
+ * @param[in] stage Name of the stage.
+ * @param[in] name Name of the script.
+ * @param[in] line The line to log.
+ */
+static void log_script(const char *stage, const char *name, const char *line)
+{
+    // If line starts with ':::', log it as-is.
+    if (strncmp(line, ":::", 3) == 0) {
+        log_message(NULL, 0, false, "%s", line + 3);
+    }
+    else {
+        log(stage, "%s: %s", name, line);
+    }
+}
+
+/**
+ * Filter used to list regular files of a directory.
+ */
+static int filter_regular_file(const struct dirent *dir)
+{
+    return dir->d_type == DT_REG || dir->d_type == DT_UNKNOWN;
+}
+
+/**
+ * List regular files of a directory, in alphabetical order.
+ *
+ * @param[in] dir Path of the directory.
+ * @param[out] namelist List of entries.  Must be freed by the caller.
+ *
+ * @return Number of entries, 0 if the directory doesn't exist or -1 on error.
+ */
+static int list_files(const char *dir, struct dirent ***namelist)
+{
+    int n = scandir(dir, namelist, filter_regular_file, alphasort);
+    if (n < 0) {
+        *namelist = NULL;
+        return (errno == ENOENT) ? 0 : -1;
+    }
+
+    // Remove entries of unknown type that are not regular files.
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        struct dirent *entry = (*namelist)[i];
+        if (entry->d_type == DT_UNKNOWN) {
+            char path[PATH_MAX];
+            struct stat st;
+
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            if (lstat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+                free(entry);
+                continue;
+            }
+        }
+        (*namelist)[count++] = entry;
+    }
+    return count;
+}
+
+/**
+ * Free a list of directory entries.
+ *
+ * @param[in] namelist The list.
+ * @param[in] n Number of entries in the list.
+ */
+static void free_list(struct dirent **namelist, int n)
+{
+    for (int i = 0; i < n; i++) {
+        free(namelist[i]);
+    }
+    free(namelist);
+}
+
+/**
+ * Check if a string is a valid environment variable name.
+ *
+ * @param[in] name The name to validate.
+ *
+ * @return true if the name is valid, false otherwise.
+ */
+static bool valid_env_var_name(const char *name)
+{
+    if (name[0] == '\0' || (name[0] >= '0' && name[0] <= '9')) {
+        return false;
+    }
+    for (const char *p = name; *p; p++) {
+        if (!(*p >= 'a' && *p <= 'z') &&
+            !(*p >= 'A' && *p <= 'Z') &&
+            !(*p >= '0' && *p <= '9') &&
+            *p != '_') {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Set an environment variable, if not already set.
+ *
+ * The variable is also saved, so it can be loaded by login shells.
+ *
+ * @param[in] name Name of the variable.
+ * @param[in] value Value of the variable.
+ */
+static void load_env_var(const char *name, const char *value)
+{
+    // Variables already set, with null or a value, are not touched.
+    if (getenv(name)) {
+        return;
+    }
+
+    setenv(name, value, 1);
+
+    FILE *f = fopen(CONT_ENV_SAVE_FILE, "ae");
+    if (f) {
+        fprintf(f, "export %s=\"%s\"\n", name, value);
+        fclose(f);
+    }
+}
+
+/**
+ * Read the first line of a file.
+ *
+ * @param[in] path Path of the file.
+ *
+ * @return Dynamically allocated line or NULL on error.
+ */
+static char *read_first_line(const char *path)
+{
+    char *line = NULL;
+    size_t linesize = 0;
+
+    FILE *f = fopen(path, "re");
+    if (!f) {
+        return NULL;
+    }
+
+    if (getline(&line, &linesize, f) < 0) {
+        // Empty file.
+        free(line);
+        line = strdup("");
+    }
+    else {
+        terminate_at_first_eol(line);
+    }
+
+    fclose(f);
+    return line;
+}
+
+/**
+ * Function invoked for each line of output of a cont-env program.
+ *
+ * The first line of stdout is the value, while stderr is logged.
+ */
+static void env_program_line(const char *line, std_output_t src, void *data)
+{
+    env_program_ctx_t *ctx = (env_program_ctx_t *)data;
+
+    if (src == STDOUT) {
+        if (!ctx->value) {
+            ctx->value = strdup(line);
+        }
+    }
+    else {
+        log_script(ctx->stage, ctx->name, line);
+    }
+}
+
+int stages_load_env(const char *dir, int prefix_length)
+{
+    const char *stage = "cont-env";
+    struct dirent **namelist;
+    int retval = 0;
+
+    g_prefix_length = prefix_length;
+
+    log(stage, "loading container environment variables...");
+
+    int n = list_files(dir, &namelist);
+    if (n < 0) {
+        log(stage, "could not list %s: %s", dir, strerror(errno));
+        return 1;
+    }
+
+    for (int i = 0; i < n && retval == 0; i++) {
+        const char *name = namelist[i]->d_name;
+        char path[PATH_MAX];
+
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+        if (!valid_env_var_name(name)) {
+            log(stage, "invalid environment variable name: %s", name);
+            retval = 1;
+            break;
+        }
+
+        if (access(path, X_OK) == 0) {
+            // The file is an executable.  The value of the environment
+            // variable is the stdout of the program.  Anything printed to
+            // stderr is redirected to the container's log.
+            env_program_ctx_t ctx = {
+                .stage = stage,
+                .name = name,
+                .value = NULL,
+            };
+
+            log(stage, "%s: executing...", name);
+            int rc = exec_cmd_with_line_callback(env_program_line, &ctx, path, name, NULL);
+            if (rc == 0 || rc == CONT_ENV_SKIP_EXIT_CODE) {
+                log(stage, "%s: terminated successfully.", name);
+            }
+            else {
+                log(stage, "%s: terminated with error %d.", name, rc < 0 ? 1 : rc);
+                retval = rc < 0 ? 1 : rc;
+            }
+
+            // Load the environment variable in case of success.
+            if (rc == 0) {
+                log(stage, "%s: loading...", name);
+                load_env_var(name, ctx.value ? ctx.value : "");
+            }
+            else if (rc == CONT_ENV_SKIP_EXIT_CODE) {
+                log(stage, "%s: not setting variable.", name);
+            }
+            free(ctx.value);
+        }
+        else {
+            log(stage, "%s: loading...", name);
+            char *value = read_first_line(path);
+            if (!value) {
+                log(stage, "%s: could not read file: %s", name, strerror(errno));
+                retval = 1;
+                break;
+            }
+            load_env_var(name, value);
+            free(value);
+        }
+    }
+
+    free_list(namelist, n);
+
+    if (retval == 0) {
+        log(stage, "container environment variables initialized.");
+    }
+    return retval;
+}
+
+int stages_load_secrets(const char *dir, int prefix_length)
+{
+    const char *stage = "cont-secrets";
+    struct dirent **namelist;
+    int retval = 0;
+
+    g_prefix_length = prefix_length;
+
+    log(stage, "loading container secrets...");
+
+    int n = list_files(dir, &namelist);
+    if (n < 0) {
+        log(stage, "could not list %s: %s", dir, strerror(errno));
+        return 1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        const char *filename = namelist[i]->d_name;
+        const char *name = filename + strlen(CONT_SECRETS_PREFIX);
+        char path[PATH_MAX];
+
+        if (strncmp(filename, CONT_SECRETS_PREFIX, strlen(CONT_SECRETS_PREFIX)) != 0) {
+            continue;
+        }
+
+        if (!valid_env_var_name(name)) {
+            log(stage, "invalid environment variable name: %s", name);
+            retval = 1;
+            break;
+        }
+
+        log(stage, "%s: loading...", name);
+        snprintf(path, sizeof(path), "%s/%s", dir, filename);
+        char *value = read_first_line(path);
+        if (!value) {
+            log(stage, "%s: could not read file: %s", name, strerror(errno));
+            retval = 1;
+            break;
+        }
+        load_env_var(name, value);
+        free(value);
+    }
+
+    free_list(namelist, n);
+
+    if (retval == 0) {
+        log(stage, "container secrets loaded.");
+    }
+    return retval;
+}
+
+/**
+ * Find an initialization script by name.
+ *
+ * @param[in] ctx The cont-init context.
+ * @param[in] name Name of the script.
+ *
+ * @return Index of the script or -1 if not found.
+ */
+static int find_script(init_ctx_t *ctx, const char *name)
+{
+    for (size_t i = 0; i < ctx->num_scripts; i++) {
+        if (strcmp(ctx->scripts[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Parse the dependencies header of an initialization script.
+ *
+ * @param[in] ctx The cont-init context.
+ * @param[in,out] script The script.
+ */
+static void parse_script_header(init_ctx_t *ctx, script_t *script)
+{
+    char *line = NULL;
+    size_t linesize = 0;
+
+    FILE *f = fopen(script->path, "re");
+    if (!f) {
+        return;
+    }
+
+    for (int i = 0; i < CONT_INIT_HEADER_MAX_LINES && getline(&line, &linesize, f) >= 0; i++) {
+        if (strncmp(line, CONT_INIT_DEPENDS_HEADER, strlen(CONT_INIT_DEPENDS_HEADER)) != 0) {
+            continue;
+        }
+
+        script->has_header = true;
+
+        char *saveptr = NULL;
+        for (char *tok = strtok_r(line + strlen(CONT_INIT_DEPENDS_HEADER), " \t\r\n", &saveptr);
+             tok;
+             tok = strtok_r(NULL, " \t\r\n", &saveptr)) {
+            // Dependencies on scripts that don't exist are ignored.
+            int dep = find_script(ctx, tok);
+            if (dep >= 0 && &ctx->scripts[dep] != script) {
+                script->deps[dep] = true;
+            }
+        }
+        break;
+    }
+
+    free(line);
+    fclose(f);
+}
+
+/**
+ * Check if a script depends, directly or indirectly, on another one.
+ *
+ * @param[in] ctx The cont-init context.
+ * @param[in] from Index of the script.
+ * @param[in] to Index of the potential dependency.
+ * @param[in,out] visited Table of scripts already visited.
+ *
+ * @return true if the script depends on the other one, false otherwise.
+ */
+static bool script_depends_on(init_ctx_t *ctx, int from, int to, bool *visited)
+{
+    if (from == to) {
+        return true;
+    }
+    visited[from] = true;
+
+    for (size_t i = 0; i < ctx->num_scripts; i++) {
+        if (ctx->scripts[from].deps[i] && !visited[i]) {
+            if (script_depends_on(ctx, i, to, visited)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * Check if all dependencies of a script are done.
+ *
+ * @param[in] ctx The cont-init context.
+ * @param[in] script The script.
+ *
+ * @return true if the script can be started, false otherwise.
+ */
+static bool script_runnable(init_ctx_t *ctx, const script_t *script)
+{
+    for (size_t i = 0; i < ctx->num_scripts; i++) {
+        if (script->deps[i] && ctx->scripts[i].state != SCRIPT_DONE) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Function invoked for each line of output of an initialization script.
+ */
+static void script_line(const char *line, std_output_t src, void *data)
+{
+    script_t *script = (script_t *)data;
+    log_script("cont-init", script->name, line);
+}
+
+/**
+ * Thread running an initialization script.
+ */
+static void *script_thread(void *p)
+{
+    script_t *script = (script_t *)p;
+    init_ctx_t *ctx = script->ctx;
+
+    int rc = exec_cmd_with_line_callback(script_line, script, script->path, script->name, NULL);
+    if (rc < 0) {
+        rc = 1;
+    }
+
+    if (rc == 0) {
+        log("cont-init", "%s: terminated successfully.", script->name);
+    }
+    else {
+        log("cont-init", "%s: terminated with error %d.", script->name, rc);
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    script->exit_code = rc;
+    script->state = SCRIPT_DONE;
+    ctx->num_running--;
+    if (rc != 0 && ctx->exit_code == 0) {
+        ctx->exit_code = rc;
+    }
+    pthread_cond_signal(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+
+    return NULL;
+}
+
+int stages_run_init(const char *dir, int prefix_length)
+{
+    const char *stage = "cont-init";
+    struct dirent **namelist;
+    init_ctx_t ctx = {
+        .scripts = NULL,
+        .num_scripts = 0,
+        .num_running = 0,
+        .exit_code = 0,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+    };
+
+    g_prefix_length = prefix_length;
+
+    log(stage, "executing container initialization scripts...");
+
+    int n = list_files(dir, &namelist);
+    if (n < 0) {
+        log(stage, "could not list %s: %s", dir, strerror(errno));
+        return 1;
+    }
+    else if (n > CONT_INIT_MAX_SCRIPTS) {
+        log(stage, "too many initialization scripts.");
+        free_list(namelist, n);
+        return 1;
+    }
+
+    ctx.scripts = calloc(n > 0 ? n : 1, sizeof(script_t));
+    if (!ctx.scripts) {
+        log(stage, "out of memory");
+        free_list(namelist, n);
+        return 1;
+    }
+
+    // Build the list of scripts.
+    for (int i = 0; i < n; i++) {
+        script_t *script = &ctx.scripts[ctx.num_scripts++];
+
+        snprintf(script->name, sizeof(script->name), "%s", namelist[i]->d_name);
+        snprintf(script->path, sizeof(script->path), "%s/%s", dir, script->name);
+        script->executable = (access(script->path, X_OK) == 0);
+    }
+    free_list(namelist, n);
+
+    // Resolve dependencies.  Scripts without header wait for all scripts
+    // sorted before them, except the ones depending on them.
+    for (size_t i = 0; i < ctx.num_scripts; i++) {
+        if (ctx.scripts[i].executable) {
+            parse_script_header(&ctx, &ctx.scripts[i]);
+        }
+    }
+    for (size_t i = 0; i < ctx.num_scripts; i++) {
+        if (ctx.scripts[i].has_header) {
+            continue;
+        }
+        for (size_t j = 0; j < i; j++) {
+            bool visited[CONT_INIT_MAX_SCRIPTS] = { false };
+            if (!script_depends_on(&ctx, j, i, visited)) {
+                ctx.scripts[i].deps[j] = true;
+            }
+        }
+    }
+
+    // Run scripts.
+    pthread_mutex_lock(&ctx.lock);
+    while (true) {
+        // Start scripts that are ready, unless a failure occurred.
+        for (size_t i = 0; i < ctx.num_scripts && ctx.exit_code == 0; i++) {
+            script_t *script = &ctx.scripts[i];
+
+            if (script->state != SCRIPT_PENDING || !script_runnable(&ctx, script)) {
+                continue;
+            }
+            else if (!script->executable) {
+                log(stage, "%s: WARNING: not executable, ignoring.", script->name);
+                script->state = SCRIPT_DONE;
+                i = -1; // Dependent scripts may now be ready.
+                continue;
+            }
+            else if (ctx.num_running >= CONT_INIT_MAX_PARALLEL_SCRIPTS) {
+                break;
+            }
+
+            log(stage, "%s: executing...", script->name);
+            script->state = SCRIPT_RUNNING;
+            script->ctx = &ctx;
+            if (pthread_create(&script->thread, NULL, script_thread, script) != 0) {
+                log(stage, "%s: could not create thread.", script->name);
+                script->state = SCRIPT_DONE;
+                ctx.exit_code = 1;
+                break;
+            }
+            script->thread_started = true;
+            ctx.num_running++;
+        }
+
+        if (ctx.num_running == 0) {
+            break;
+        }
+        pthread_cond_wait(&ctx.cond, &ctx.lock);
+    }
+    pthread_mutex_unlock(&ctx.lock);
+
+    // Release threads and check for scripts that could not be run.
+    for (size_t i = 0; i < ctx.num_scripts; i++) {
+        script_t *script = &ctx.scripts[i];
+        if (script->thread_started) {
+            pthread_join(script->thread, NULL);
+        }
+        else if (script->state == SCRIPT_PENDING && ctx.exit_code == 0) {
+            log(stage, "%s: dependency loop detected.", script->name);
+            ctx.exit_code = 1;
+        }
+    }
+
+    free(ctx.scripts);
+
+    if (ctx.exit_code == 0) {
+        log(stage, "all container initialization scripts executed.");
+    }
+    return ctx.exit_code;
+}
@@ -0,0 +1,62 @@
+#ifndef __CINIT_STAGES_H__
+#define __CINIT_STAGES_H__
+
+/**
+ * Container initialization stages.
+ *
+ * These stages are executed before services are started:
+ *
+ *   - cont-env: Each file of the directory defines an environment variable.
+ *     The name of the file is the name of the variable and its first line is
+ *     the value.  When the file is executable, the value is the first line of
+ *     its output.  An executable exiting with code 100 doesn't set the
+ *     variable.
+ *   - cont-secrets: Docker secrets named CONT_ENV_<NAME> define the
+ *     environment variable <NAME>.
+ *   - cont-init: Each executable file of the directory is a script to run.
+ *
+ * Environment variables already set are never overwritten.
+ *
+ * By default, initialization scripts run one after the other, in alphabetical
+ * order.  A script can declare its dependencies with a header placed in its
+ * first lines:
+ *
+ *   # cinit-depends: 10-clean-tmp-dir.sh 10-init-users.sh
+ *
+ * A script with this header waits only for the listed scripts (scripts that
+ * don't exist are ignored) and may run in parallel with others.  An empty list
+ * means the script has no dependency.  A script without the header waits for
+ * all scripts sorted before it, except the ones depending on it.
+ */
+
+/**
+ * Load environment variables from a cont-env directory.
+ *
+ * @param[in] dir Path of the directory.
+ * @param[in] prefix_length Length of log prefixes.
+ *
+ * @return 0 on success, the exit code to use on error.
+ */
+int stages_load_env(const char *dir, int prefix_length);
+
+/**
+ * Load environment variables from Docker secrets.
+ *
+ * @param[in] dir Path of the secrets directory.
+ * @param[in] prefix_length Length of log prefixes.
+ *
+ * @return 0 on success, the exit code to use on error.
+ */
+int stages_load_secrets(const char *dir, int prefix_length);
+
+/**
+ * Run the initialization scripts of a cont-init directory.
+ *
+ * @param[in] dir Path of the directory.
+ * @param[in] prefix_length Length of log prefixes.
+ *
+ * @return 0 on success, the exit code to use on error.
+ */
+int stages_run_init(const char *dir, int prefix_length);
+
+#endif // __CINIT_STAGES_H__
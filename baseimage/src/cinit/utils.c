@@ -1,4 +1,7 @@
+#define _GNU_SOURCE
+
 #include <stdlib.h>
+#include <stdint.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
@@ -10,8 +13,14 @@
 #include <poll.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "utils.h"
+#include "snapshot.h"
 #include "CException.h"
 
 #define MAX(a, b) ((a)>=(b)?(a):(b))
@@ -24,7 +33,9 @@
 
 typedef struct {
     char buf[4096];
-    size_t used;
+    size_t start;   /**< Offset of the current, incomplete line. */
+    size_t scanned; /**< Offset up to which the current line has been searched for EOL. */
+    size_t used;    /**< Number of bytes in the buffer. */
     bool eof;
 } output_read_state_t;
 
@@ -241,6 +252,83 @@ char **split(char *buf, int c, size_t *len, int plus, int ofs)
     return vector;
 }
 
+/**
+ * Find the first end-of-line character ('\n' or '\r') of a buffer.
+ *
+ * @param[in] s The buffer.
+ * @param[in] len Length of the buffer.
+ *
+ * @return Pointer to the end-of-line character or NULL if not found.
+ */
+static char *find_eol(char *s, size_t len)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, cr)));
+        if (mask) {
+            return s + i + __builtin_ctz(mask);
+        }
+    }
+#elif defined(__ARM_NEON)
+    const uint8x16_t nl = vdupq_n_u8('\n');
+    const uint8x16_t cr = vdupq_n_u8('\r');
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)s + i);
+        uint8x16_t m = vorrq_u8(vceqq_u8(v, nl), vceqq_u8(v, cr));
+        // Narrow the comparison result to 4 bits per byte.
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+        if (mask) {
+            return s + i + (__builtin_ctzll(mask) >> 2);
+        }
+    }
+#else
+    // Process 8 bytes at a time, stopping at the first word containing an
+    // end-of-line character.
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, s + i, sizeof(w));
+        uint64_t a = w ^ (ones * '\n');
+        uint64_t b = w ^ (ones * '\r');
+        if (((a - ones) & ~a & highs) || ((b - ones) & ~b & highs)) {
+            break;
+        }
+    }
+#endif
+
+    for (; i < len; i++) {
+        if (s[i] == '\n' || s[i] == '\r') {
+            return s + i;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Invoke the callback with the incomplete line of a read state, if any.
+ *
+ * @param[in] rstate The read state.
+ * @param[in] fd File descriptor associated to the read state.
+ * @param[in] callback Function to be invoked.
+ * @param[in] callback_data Custom data to be passed to the callback function.
+ */
+static void flush_read_state(output_read_state_t *rstate, int fd, line_callback_t callback, void *callback_data)
+{
+    rstate->buf[rstate->used] = '\0';
+    if (rstate->buf[rstate->start] != '\0') {
+        callback(fd, rstate->buf + rstate->start, callback_data);
+    }
+    rstate->start = 0;
+    rstate->scanned = 0;
+    rstate->used = 0;
+}
+
 int read_lines(int *fds, size_t num_fds, line_callback_t callback, exit_callback_t exit_callback, void *callback_data)
 {
     int retval = 0;
@@ -306,11 +394,7 @@ int read_lines(int *fds, size_t num_fds, line_callback_t callback, exit_callback
             else if (pfds[i].revents & (POLLHUP | POLLERR | POLLNVAL)) {
                 // The other end of the pipe has been closed.
                 rstate->eof = true;
-                rstate->buf[rstate->used] = '\0';
-                rstate->used = 0;
-                if (rstate->buf[0] != '\0') {
-                    callback(pfds[i].fd, rstate->buf, callback_data);
-                }
+                flush_read_state(rstate, pfds[i].fd, callback, callback_data);
                 continue;
             }
             else {
@@ -319,15 +403,22 @@ int read_lines(int *fds, size_t num_fds, line_callback_t callback, exit_callback
                 continue;
             }
 
-            // Get the maximum number of bytes to read.
+            // Get the maximum number of bytes to read.  When running out of
+            // space, move the incomplete line to the beginning of the buffer.
+            // This is done only once per buffer fill, not once per line.
             size_t max_to_read = sizeof(rstate->buf) - rstate->used - 1;
+            if (max_to_read < sizeof(rstate->buf) / 4 && rstate->start > 0) {
+                rstate->used -= rstate->start;
+                rstate->scanned -= rstate->start;
+                memmove(rstate->buf, rstate->buf + rstate->start, rstate->used);
+                rstate->start = 0;
+                max_to_read = sizeof(rstate->buf) - rstate->used - 1;
+            }
 
             // If there is nothing to read, line is too big to fit in buffer.
             // We need to flush the buffer.
             if (max_to_read == 0) {
-                rstate->buf[rstate->used] = '\0';
-                rstate->used = 0;
-                callback(pfds[i].fd, rstate->buf, callback_data);
+                flush_read_state(rstate, pfds[i].fd, callback, callback_data);
                 continue;
             }
 
@@ -344,44 +435,32 @@ int read_lines(int *fds, size_t num_fds, line_callback_t callback, exit_callback
             else if (bytes_read == 0) {
                 // EOF.  Line is complete.
                 rstate->eof = true;
-                rstate->buf[rstate->used] = '\0';
-                rstate->used = 0;
-                if (rstate->buf[0] != '\0') {
-                    callback(pfds[i].fd, rstate->buf, callback_data);
-                }
+                flush_read_state(rstate, pfds[i].fd, callback, callback_data);
                 continue;
             }
             else {
                 rstate->used += bytes_read;
             }
 
-            // Check if we have a complete line.
-            while (true) {
-                bool complete_line = false;
-                for (unsigned int j = 0; j < rstate->used; j++) {
-                    if (rstate->buf[j] == '\n' || rstate->buf[j] == '\r') {
-                        rstate->buf[j] = '\0';
-
-                        // We have a complete line.
-                        complete_line = true;
-                        if (j != 0) {
-                            // Invoke the callback.
-                            callback(pfds[i].fd, rstate->buf, callback_data);
-                        }
-
-                        // Adjust the buffer.
-                        rstate->used -= (j + 1);
-                        if (rstate->used > 0) {
-                            memmove(rstate->buf, rstate->buf + j + 1, rstate->used);
-                        }
-                        break;
-                    }
+            // Invoke the callback for each complete line.  Search resumes
+            // where the previous one stopped and lines are passed in place.
+            char *eol;
+            while ((eol = find_eol(rstate->buf + rstate->scanned, rstate->used - rstate->scanned))) {
+                *eol = '\0';
+                size_t end = eol - rstate->buf;
+                if (end != rstate->start) {
+                    callback(pfds[i].fd, rstate->buf + rstate->start, callback_data);
                 }
+                rstate->start = end + 1;
+                rstate->scanned = end + 1;
+            }
+            rstate->scanned = rstate->used;
 
-                // Continue until we don't find complete lines.
-                if (!complete_line) {
-                    break;
-                }
+            // Rewind the buffer when all its data has been consumed.
+            if (rstate->start == rstate->used) {
+                rstate->start = 0;
+                rstate->scanned = 0;
+                rstate->used = 0;
             }
         }
 
@@ -642,9 +721,112 @@ void string_to_mode(const char *str, mode_t *result)
     *result = val;
 }
 
+void string_to_cpu_set(const char *str, cpu_set_t *result)
+{
+    const char *p = str;
+
+    CPU_ZERO(result);
+
+    while (true) {
+        char *endptr;
+        unsigned long first, last;
+
+        // Get the first CPU of the range.
+        if (!isdigit(*p)) {
+            ThrowMessage("invalid CPU list");
+        }
+        first = last = strtoul(p, &endptr, 10);
+        p = endptr;
+
+        // Get the last CPU of the range.
+        if (*p == '-') {
+            p++;
+            if (!isdigit(*p)) {
+                ThrowMessage("invalid CPU list");
+            }
+            last = strtoul(p, &endptr, 10);
+            p = endptr;
+        }
+
+        if (first > last) {
+            ThrowMessage("invalid CPU range");
+        }
+        else if (last >= CPU_SETSIZE) {
+            ThrowMessage("out of range");
+        }
+
+        for (unsigned long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, result);
+        }
+
+        if (*p == '\0') {
+            break;
+        }
+        else if (*p != ',') {
+            ThrowMessage("invalid CPU list");
+        }
+        p++;
+    }
+}
+
+void string_to_sched_policy(const char *str, int *result)
+{
+    if (strcasecmp(str, "other") == 0 || strcasecmp(str, "normal") == 0) {
+        *result = SCHED_OTHER;
+    }
+    else if (strcasecmp(str, "batch") == 0) {
+        *result = SCHED_BATCH;
+    }
+    else if (strcasecmp(str, "idle") == 0) {
+        *result = SCHED_IDLE;
+    }
+    else {
+        ThrowMessage("unsupported scheduling policy");
+    }
+}
+
+void string_to_io_class(const char *str, int *result)
+{
+    if (strcasecmp(str, "none") == 0) {
+        *result = IOPRIO_CLASS_NONE;
+    }
+    else if (strcasecmp(str, "best-effort") == 0) {
+        *result = IOPRIO_CLASS_BE;
+    }
+    else if (strcasecmp(str, "idle") == 0) {
+        *result = IOPRIO_CLASS_IDLE;
+    }
+    else {
+        ThrowMessage("unsupported I/O scheduling class");
+    }
+}
+
 bool load_value_as_string(const char *filepath, char **buf, size_t bufsize)
 {
     struct stat fileinfo;
+    snapshot_item_t item;
+
+    // Check the services configuration snapshot first.  Executable items
+    // still need to be run.
+    switch (snapshot_lookup(filepath, &item)) {
+        case 0:
+            // Config value not set.
+            return false;
+        case 1:
+            if (!item.executable) {
+                CEXCEPTION_T e;
+
+                Try {
+                    snapshot_read_item(&item, buf, bufsize);
+                }
+                Catch (e) {
+                    ThrowMessage("could not load '%s': %s", filepath, e.mMessage);
+                }
+                return true;
+            }
+            break;
+    }
+
     int rc = stat(filepath, &fileinfo);
 
     // Check if the file exists and is executable.
@@ -896,3 +1078,81 @@ bool load_value_as_mode(const char *filepath, mode_t *result)
 
     return true;
 }
+
+bool load_value_as_cpu_set(const char *filepath, cpu_set_t *result)
+{
+    CEXCEPTION_T e;
+
+    char buf[256];
+    char *bufptr = buf;
+
+    // Get value from file.
+    if (!load_value_as_string(filepath, &bufptr, sizeof(buf))) {
+        return false;
+    }
+
+    terminate_at_first_eol(buf);
+    trim(buf);
+
+    // Convert.
+    Try {
+        string_to_cpu_set(buf, result);
+    }
+    Catch (e) {
+        ThrowMessage("could not load '%s': %s", filepath, e.mMessage);
+    }
+
+    return true;
+}
+
+bool load_value_as_sched_policy(const char *filepath, int *result)
+{
+    CEXCEPTION_T e;
+
+    char buf[256];
+    char *bufptr = buf;
+
+    // Get value from file.
+    if (!load_value_as_string(filepath, &bufptr, sizeof(buf))) {
+        return false;
+    }
+
+    terminate_at_first_eol(buf);
+    trim(buf);
+
+    // Convert.
+    Try {
+        string_to_sched_policy(buf, result);
+    }
+    Catch (e) {
+        ThrowMessage("could not load '%s': %s", filepath, e.mMessage);
+    }
+
+    return true;
+}
+
+bool load_value_as_io_class(const char *filepath, int *result)
+{
+    CEXCEPTION_T e;
+
+    char buf[256];
+    char *bufptr = buf;
+
+    // Get value from file.
+    if (!load_value_as_string(filepath, &bufptr, sizeof(buf))) {
+        return false;
+    }
+
+    terminate_at_first_eol(buf);
+    trim(buf);
+
+    // Convert.
+    Try {
+        string_to_io_class(buf, result);
+    }
+    Catch (e) {
+        ThrowMessage("could not load '%s': %s", filepath, e.mMessage);
+    }
+
+    return true;
+}
@@ -3,10 +3,18 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <sched.h>
 #include <sys/types.h>
 
 #define DIM(a) (sizeof(a)/sizeof(a[0]))
 
+/**
+ * I/O scheduling classes, as defined by the kernel.
+ */
+#define IOPRIO_CLASS_NONE 0
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+
 /**
  * Enumeration to identify a standard output stream.
  */
@@ -204,6 +212,36 @@ void string_to_gid(const char *str, gid_t *result);
  */
 void string_to_mode(const char *str, mode_t *result);
 
+#ifdef CPU_SETSIZE
+/**
+ * Convert a string to a CPU set.
+ *
+ * The string is a comma separated list of CPU numbers or ranges (e.g.
+ * "0-1,3").
+ *
+ * @param[in] str Input string to convert.
+ * @param[out] result Where to store the converted value.
+ */
+void string_to_cpu_set(const char *str, cpu_set_t *result);
+#endif
+
+/**
+ * Convert a string to a scheduling policy value.
+ *
+ * @param[in] str Input string to convert: other, batch or idle.
+ * @param[out] result Where to store the converted value (SCHED_* value).
+ */
+void string_to_sched_policy(const char *str, int *result);
+
+/**
+ * Convert a string to an I/O scheduling class value.
+ *
+ * @param[in] str Input string to convert: none, best-effort or idle.
+ * @param[out] result Where to store the converted value (IOPRIO_CLASS_*
+ *                    value).
+ */
+void string_to_io_class(const char *str, int *result);
+
 /**
  * Load configuration item as a string value.
  *
@@ -289,4 +327,36 @@ bool load_value_as_gid(const char *filepath, gid_t *result);
  */
 bool load_value_as_mode(const char *filepath, mode_t *result);
 
+#ifdef CPU_SETSIZE
+/**
+ * Load configuration item as a CPU set value.
+ *
+ * @param[in] filepath Path to the configuration item file to load.
+ * @param[out] result Where the result will be stored.
+ *
+ * @return true if the value was loaded, false if value was not set.
+ */
+bool load_value_as_cpu_set(const char *filepath, cpu_set_t *result);
+#endif
+
+/**
+ * Load configuration item as a scheduling policy value.
+ *
+ * @param[in] filepath Path to the configuration item file to load.
+ * @param[out] result Where the result will be stored.
+ *
+ * @return true if the value was loaded, false if value was not set.
+ */
+bool load_value_as_sched_policy(const char *filepath, int *result);
+
+/**
+ * Load configuration item as an I/O scheduling class value.
+ *
+ * @param[in] filepath Path to the configuration item file to load.
+ * @param[out] result Where the result will be stored.
+ *
+ * @return true if the value was loaded, false if value was not set.
+ */
+bool load_value_as_io_class(const char *filepath, int *result);
+
 #endif // __CINIT_UTILS_H__